@@ -1,6 +1,8 @@
 #!/bin/bash
 
-# first argument is the name of the client
+# first argument is the name of the client.
+# The key algorithm (rsa, ec or ed) is the one chosen in setup_ca.sh, read by
+# easyrsa from ./easyrsa/pki/vars
 export EASYRSA_CERT_EXPIRE=9999
 
 # Validate the number of arguments
@@ -34,4 +36,8 @@ echo "Copying ./pki/issued/${1}.crt to ./certs/"
 cp ./pki/issued/${1}.crt ../certs/
 cd ..
 
+# Key for single packet (SPA) knocks, shared by the client and the daemon
+echo "Generating SPA key ./certs/${1}.spa"
+(umask 077 && openssl rand -hex 32 > ./certs/${1}.spa)
+
 echo "Done."
\ No newline at end of file
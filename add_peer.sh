@@ -0,0 +1,34 @@
+#!/bin/bash
+
+# Usage: ./add_peer.sh gateway_name
+# Creates the certificate a gateway uses to replicate its grants to the other
+# gateways (see PEERS in daemon/config.py). It can be used both as a client and
+# as a server certificate. Add gateway_name to PEER_NAMES on all the gateways.
+export EASYRSA_CERT_EXPIRE=9999
+
+# Validate the number of arguments
+if [[ $# -ne 1 ]]; then
+  echo "Usage: add_peer.sh gateway_name"
+  exit 1
+fi
+
+if [[ ! $1 =~ ^[a-zA-Z0-9._\-]+$ ]]; then
+  echo "The gateway name can only contain letters, numbers and the symbols - _ and ."
+  exit 3
+fi
+
+echo "Creating peer certificate..."
+cd easyrsa
+echo "Generating request..."
+./easyrsa gen-req ${1} nopass
+echo "Signing request..."
+./easyrsa sign-req serverClient ${1}
+
+echo "Copying ./pki/private/${1}.key to ../certs/"
+cp ./pki/private/${1}.key ../certs/
+echo "Copying ./pki/issued/${1}.crt to ../certs/"
+cp ./pki/issued/${1}.crt ../certs/
+cd ..
+
+echo "Install ./certs/${1}.crt and ./certs/${1}.key on the gateway as its PEER_CERT_FILE and PEER_KEY_FILE."
+echo "Done."
@@ -0,0 +1,17 @@
+"""
+Writes config.h for the C client from the Python client configuration, so both
+clients have the same defaults. Usage: gen_config.py ../python-client/config.py
+"""
+
+import json
+import runpy
+import sys
+
+SETTINGS = ['DEFAULT_SERVER', 'DEFAULT_PORT', 'CLIENT_CERT', 'CLIENT_KEY', 'CA_CERT', 'SPA_KEY_FILE']
+
+config = runpy.run_path(sys.argv[1])
+print(f"/* Generated from {sys.argv[1]} by gen_config.py, do not edit */")
+for name in SETTINGS:
+    # JSON strings are valid C string literals for these plain ASCII values
+    value = config[name]
+    print(f"#define {name} {json.dumps(value) if isinstance(value, str) else int(value)}")
@@ -0,0 +1,411 @@
+/*
+ * Native openme client, for the hosts where starting the Python client takes
+ * longer than the knock itself: login hooks, routers. It sends the same JSON
+ * open request (see daemon/protocol.py), or the same single packet knock
+ * (see daemon/spa.py), as python-client/openme.py, with the defaults of
+ * python-client/config.py compiled in (see gen_config.py).
+ *
+ *   openme [-s server] [-p port] [-i ip] [--targets a,b] [--ports 80,8000-8010]
+ *          [--protos tcp] [--spa]
+ *
+ * The connection has TCP_NODELAY set and the request is written as soon as the
+ * handshake is done, so a knock takes the TCP and TLS round trips and nothing
+ * else. Like the Python client, it only knocks again when there was no reply
+ * or the server could not update its firewall (code 503).
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/ssl.h>
+
+#include "config.h"
+
+/* Knocks are sent again, up to KNOCK_ATTEMPTS times, without a reply or on 503 */
+#define KNOCK_ATTEMPTS 3
+#define RETRY_CODE 503
+/* Seconds to wait for the server, so a hook never hangs */
+#define TIMEOUT 10
+#define REQUEST_SIZE 4096
+#define REPLY_SIZE 4096
+/* Characters of IPv4 and IPv6 addresses and networks, which need no escaping */
+#define ADDRESS_CHARACTERS "0123456789abcdefABCDEF.:/"
+
+struct options {
+    const char *server;
+    const char *port;
+    const char *ip_address;
+    const char *targets;
+    const char *ports;
+    const char *protos;
+    int spa;
+};
+
+struct reply {
+    /* 0 without a reply */
+    int code;
+    int ok;
+    long rules;
+    /* 0 for grants that never expire */
+    double expires;
+    char error[256];
+};
+
+static void fail(const char *format, ...)
+{
+    va_list args;
+
+    va_start(args, format);
+    fputs("Error: ", stderr);
+    vfprintf(stderr, format, args);
+    fputc('\n', stderr);
+    va_end(args);
+    exit(1);
+}
+
+static const char *ssl_error(void)
+{
+    unsigned long error = ERR_get_error();
+
+    return error ? ERR_reason_error_string(error) : strerror(errno);
+}
+
+/* Appends the comma separated items of list to the JSON array being built in
+ * request. Items are numbers when quote is not set. Only the characters in
+ * allowed are accepted, so nothing needs escaping. */
+static void append_list(char *request, const char *name, const char *list, const char *allowed, int quote)
+{
+    char *items = strdup(list);
+    char *item, *state = NULL;
+    int first = 1;
+
+    snprintf(request + strlen(request), REQUEST_SIZE - strlen(request), ", \"%s\": [", name);
+    for (item = strtok_r(items, ",", &state); item; item = strtok_r(NULL, ",", &state)) {
+        if (strspn(item, allowed) != strlen(item))
+            fail("invalid %s: %s", name, item);
+        /* Port ranges are strings, single ports numbers */
+        int as_string = quote || strchr(item, '-');
+        snprintf(request + strlen(request), REQUEST_SIZE - strlen(request), "%s%s%s%s",
+                 first ? "" : ", ", as_string ? "\"" : "", item, as_string ? "\"" : "");
+        first = 0;
+    }
+    strncat(request, "]", REQUEST_SIZE - strlen(request) - 1);
+    free(items);
+}
+
+static void open_request(const struct options *options, char *request)
+{
+    const char *targets = options->targets ? options->targets : options->ip_address;
+
+    snprintf(request, REQUEST_SIZE, "{\"v\": 1, \"op\": \"open\"");
+    if (targets)
+        append_list(request, "targets", targets, ADDRESS_CHARACTERS, 1);
+    if (options->ports)
+        append_list(request, "ports", options->ports, "0123456789-", 0);
+    if (options->protos)
+        append_list(request, "protos", options->protos, "tcpudp", 1);
+    if (strlen(request) + 3 >= REQUEST_SIZE)
+        fail("request too large");
+    strcat(request, "}\n");
+}
+
+/* Value of "name": in the JSON object of the reply, NULL if missing */
+static const char *json_field(const char *reply, const char *name)
+{
+    char key[64];
+    const char *value;
+
+    snprintf(key, sizeof(key), "\"%s\":", name);
+    value = strstr(reply, key);
+    if (!value)
+        return NULL;
+    value += strlen(key);
+    while (*value == ' ')
+        value++;
+    return value;
+}
+
+static void parse_reply(const char *line, struct reply *reply)
+{
+    const char *value;
+
+    memset(reply, 0, sizeof(*reply));
+    if ((value = json_field(line, "code")))
+        reply->code = atoi(value);
+    if ((value = json_field(line, "status")))
+        reply->ok = strncmp(value, "\"ok\"", 4) == 0;
+    if ((value = json_field(line, "rules")))
+        reply->rules = atol(value);
+    if ((value = json_field(line, "expires")) && strncmp(value, "null", 4) != 0)
+        reply->expires = atof(value);
+    if ((value = json_field(line, "error")) && *value == '"') {
+        size_t length = strcspn(value + 1, "\"");
+
+        if (length >= sizeof(reply->error))
+            length = sizeof(reply->error) - 1;
+        memcpy(reply->error, value + 1, length);
+    }
+    if (!reply->code && !reply->ok && !reply->error[0])
+        snprintf(reply->error, sizeof(reply->error), "invalid reply from the server");
+}
+
+static int connect_to(const char *server, const char *port, int type, struct sockaddr_storage *address, socklen_t *length)
+{
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = type };
+    struct addrinfo *addresses, *candidate;
+    struct timeval timeout = { .tv_sec = TIMEOUT };
+    int sock = -1, status;
+
+    if ((status = getaddrinfo(server, port, &hints, &addresses)) != 0)
+        fail("cannot resolve %s: %s", server, gai_strerror(status));
+    /* The server may be reached over IPv4 or IPv6, try its addresses in order */
+    for (candidate = addresses; candidate; candidate = candidate->ai_next) {
+        sock = socket(candidate->ai_family, candidate->ai_socktype, candidate->ai_protocol);
+        if (sock < 0)
+            continue;
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        if (type == SOCK_DGRAM) {
+            memcpy(address, candidate->ai_addr, candidate->ai_addrlen);
+            *length = candidate->ai_addrlen;
+            break;
+        }
+        if (connect(sock, candidate->ai_addr, candidate->ai_addrlen) == 0)
+            break;
+        close(sock);
+        sock = -1;
+    }
+    freeaddrinfo(addresses);
+    return sock;
+}
+
+static SSL_CTX *create_context(void)
+{
+    /* The server certificate is verified against the CA, but not its
+     * hostname, so the server can be reached by IP address */
+    SSL_CTX *context = SSL_CTX_new(TLS_client_method());
+
+    if (!context
+        || SSL_CTX_use_certificate_chain_file(context, CLIENT_CERT) != 1
+        || SSL_CTX_use_PrivateKey_file(context, CLIENT_KEY, SSL_FILETYPE_PEM) != 1
+        || SSL_CTX_load_verify_locations(context, CA_CERT, NULL) != 1)
+        fail("cannot load the certificates: %s", ssl_error());
+    SSL_CTX_set_verify(context, SSL_VERIFY_PEER, NULL);
+    return context;
+}
+
+/* Connects, sends the request and reads its reply. Returns -1 if the
+ * handshake failed, which knocking again would not fix, such as a revoked
+ * certificate. session is resumed, and replaced by the new one. */
+static int knock(SSL_CTX *context, SSL_SESSION **session, const struct options *options, const char *request,
+                 struct reply *reply)
+{
+    char line[REPLY_SIZE];
+    int sock, length = 0, received, one = 1, result = 0;
+    SSL *ssl;
+
+    memset(reply, 0, sizeof(*reply));
+    sock = connect_to(options->server, options->port, SOCK_STREAM, NULL, NULL);
+    if (sock < 0) {
+        snprintf(reply->error, sizeof(reply->error), "cannot connect to %s: %s", options->server, strerror(errno));
+        return 0;
+    }
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    ssl = SSL_new(context);
+    SSL_set_fd(ssl, sock);
+    if (*session)
+        SSL_set_session(ssl, *session);
+    if (SSL_connect(ssl) != 1) {
+        snprintf(reply->error, sizeof(reply->error), "%s", ssl_error());
+        result = -1;
+        goto done;
+    }
+    if (SSL_write(ssl, request, strlen(request)) <= 0) {
+        snprintf(reply->error, sizeof(reply->error), "%s", ssl_error());
+        goto done;
+    }
+    /* One JSON reply, terminated by a newline */
+    while (length < REPLY_SIZE - 1 && !memchr(line, '\n', length)) {
+        received = SSL_read(ssl, line + length, REPLY_SIZE - 1 - length);
+        if (received <= 0)
+            break;
+        length += received;
+    }
+    line[length] = '\0';
+    if (length)
+        parse_reply(line, reply);
+    else
+        snprintf(reply->error, sizeof(reply->error), "no reply from the server");
+
+    /* TLS 1.3 session tickets arrive after the handshake, read along with the reply */
+    if (*session)
+        SSL_SESSION_free(*session);
+    *session = SSL_get1_session(ssl);
+done:
+    SSL_free(ssl);
+    close(sock);
+    return result;
+}
+
+static int knock_and_retry(const struct options *options)
+{
+    char request[REQUEST_SIZE];
+    SSL_CTX *context = create_context();
+    SSL_SESSION *session = NULL;
+    struct reply reply;
+    int attempt;
+
+    open_request(options, request);
+    for (attempt = 0; attempt < KNOCK_ATTEMPTS; attempt++) {
+        if (knock(context, &session, options, request, &reply) < 0)
+            break;
+        if (reply.code && reply.code != RETRY_CODE)
+            break;
+        if (attempt < KNOCK_ATTEMPTS - 1)
+            usleep((useconds_t)((0.5 + rand() / (2.0 * RAND_MAX)) * (1 << attempt) * 1000000));
+    }
+
+    if (!reply.ok) {
+        printf("Error: %s\n", reply.error);
+    } else if (!reply.expires) {
+        printf("%ld rules opened\n", reply.rules);
+    } else {
+        time_t expires = (time_t)reply.expires;
+
+        /* Same format as time.ctime() */
+        printf("%ld rules opened until %.24s\n", reply.rules, ctime(&expires));
+    }
+    return reply.ok ? 0 : 1;
+}
+
+/* Sends the knock as one datagram, encrypted and authenticated with the SPA
+ * key. The format is described in daemon/spa.py */
+static int spa_knock(const struct options *options)
+{
+    unsigned char key[32], nonce[12], datagram[1024], plaintext[512], *out;
+    /* The name of the key file, without its extension, identifies the key */
+    const char *file = strrchr(SPA_KEY_FILE, '/') ? strrchr(SPA_KEY_FILE, '/') + 1 : SPA_KEY_FILE;
+    size_t name_length = strrchr(file, '.') ? (size_t)(strrchr(file, '.') - file) : strlen(file);
+    size_t header_length = 2 + name_length, plaintext_length;
+    unsigned long long now_ms;
+    int command_length;
+    struct sockaddr_storage address;
+    struct timeval now;
+    socklen_t address_length;
+    char hex[65];
+    int length, sock, i;
+
+    if (name_length > 255)
+        fail("SPA key name too long");
+    EVP_CIPHER_CTX *cipher;
+    FILE *key_file;
+
+    if (!(key_file = fopen(SPA_KEY_FILE, "r")) || fscanf(key_file, "%64s", hex) != 1 || strlen(hex) != 64)
+        fail("cannot read the SPA key %s", SPA_KEY_FILE);
+    fclose(key_file);
+    for (i = 0; i < 32; i++)
+        sscanf(hex + 2 * i, "%2hhx", &key[i]);
+
+    datagram[0] = 1;
+    datagram[1] = name_length;
+    memcpy(datagram + 2, file, name_length);
+    if (RAND_bytes(nonce, sizeof(nonce)) != 1)
+        fail("no random data: %s", ssl_error());
+    memcpy(datagram + header_length, nonce, sizeof(nonce));
+
+    /* Milliseconds since the epoch, big endian, then the command */
+    gettimeofday(&now, NULL);
+    now_ms = (unsigned long long)now.tv_sec * 1000 + now.tv_usec / 1000;
+    for (i = 0; i < 8; i++)
+        plaintext[i] = now_ms >> (56 - 8 * i);
+    if (options->ip_address && strspn(options->ip_address, ADDRESS_CHARACTERS) != strlen(options->ip_address))
+        fail("invalid address: %s", options->ip_address);
+    command_length = snprintf((char *)plaintext + 8, sizeof(plaintext) - 8, "OPEN %s",
+                              options->ip_address ? options->ip_address : "ME");
+    /* The datagram is sized for the longest command that fits in plaintext */
+    if (command_length < 0 || (size_t)command_length >= sizeof(plaintext) - 8)
+        fail("address too long: %s", options->ip_address);
+    plaintext_length = 8 + command_length;
+
+    /* AES-256-GCM, the header is authenticated, the tag follows the ciphertext */
+    out = datagram + header_length + sizeof(nonce);
+    cipher = EVP_CIPHER_CTX_new();
+    if (!cipher
+        || EVP_EncryptInit_ex(cipher, EVP_aes_256_gcm(), NULL, key, nonce) != 1
+        || EVP_EncryptUpdate(cipher, NULL, &length, datagram, header_length) != 1
+        || EVP_EncryptUpdate(cipher, out, &length, plaintext, plaintext_length) != 1
+        || EVP_EncryptFinal_ex(cipher, out + length, &length) != 1
+        || EVP_CIPHER_CTX_ctrl(cipher, EVP_CTRL_GCM_GET_TAG, 16, out + plaintext_length) != 1)
+        fail("cannot encrypt the knock: %s", ssl_error());
+    EVP_CIPHER_CTX_free(cipher);
+
+    sock = connect_to(options->server, options->port, SOCK_DGRAM, &address, &address_length);
+    if (sock < 0 || sendto(sock, datagram, out + plaintext_length + 16 - datagram, 0,
+                           (struct sockaddr *)&address, address_length) < 0)
+        fail("cannot send the knock to %s: %s", options->server, strerror(errno));
+    close(sock);
+    return 0;
+}
+
+static void usage(const char *program)
+{
+    printf("Usage: %s [options]\n"
+           "  -s, --server SERVER   Server address (default: %s)\n"
+           "  -p, --port PORT       Server port (default: %d)\n"
+           "  -i, --ip-address IP   Open ports to this IP address (default: your IP)\n"
+           "      --targets LIST    Open ports to all these comma separated IP addresses and networks\n"
+           "      --ports LIST      Only open these ports or port ranges (e.g. 80,8000-8010)\n"
+           "      --protos LIST     Only open these protocols (tcp, udp)\n"
+           "      --spa             Knock with a single UDP packet instead of a TLS connection\n",
+           program, DEFAULT_SERVER, DEFAULT_PORT);
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option long_options[] = {
+        { "server", required_argument, NULL, 's' },
+        { "port", required_argument, NULL, 'p' },
+        { "ip-address", required_argument, NULL, 'i' },
+        { "targets", required_argument, NULL, 't' },
+        { "ports", required_argument, NULL, 'P' },
+        { "protos", required_argument, NULL, 'r' },
+        { "spa", no_argument, NULL, 'S' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 },
+    };
+    char default_port[8];
+    struct options options = { .server = DEFAULT_SERVER, .port = default_port };
+    int option;
+
+    snprintf(default_port, sizeof(default_port), "%d", DEFAULT_PORT);
+    while ((option = getopt_long(argc, argv, "s:p:i:h", long_options, NULL)) != -1) {
+        switch (option) {
+        case 's': options.server = optarg; break;
+        case 'p': options.port = optarg; break;
+        case 'i': options.ip_address = optarg; break;
+        case 't': options.targets = optarg; break;
+        case 'P': options.ports = optarg; break;
+        case 'r': options.protos = optarg; break;
+        case 'S': options.spa = 1; break;
+        case 'h': usage(argv[0]); return 0;
+        default: usage(argv[0]); return 2;
+        }
+    }
+    srand(getpid() ^ time(NULL));
+    return options.spa ? spa_knock(&options) : knock_and_retry(&options);
+}
@@ -0,0 +1,166 @@
+"""
+Administration of the grants, and traces of the knocks, on the Unix socket
+config.ADMIN_SOCKET (see openmectl.py).
+
+Each request is one JSON line, answered with one JSON line, as in protocol.py:
+
+  {"v": 1, "op": "list", "filter": {...}}
+  {"v": 1, "op": "revoke", "filter": {...}}
+  {"v": 1, "op": "trace", "limit": 20, "min_duration": 0.5}
+
+The filter selects the grants by "ip" (an address or network, which matches the
+grants to that address or to addresses within that network), "port", "proto"
+and "owner", the name of the client certificate or SPA key that asked for the
+grant. Criteria left out match all the grants. list replies with {"v": 1,
+"status": "ok", "code": 200, "grants": [{"ip": ..., "port": ..., "proto": ...,
+"expires": <unix time or null>, "owner": <name or null>}, ...]} and revoke with
+{"v": 1, "status": "ok", "code": 200, "revoked": <number of rules>}. To revoke
+all the grants, the filter must be {"all": true}.
+
+trace replies with {"v": 1, "status": "ok", "code": 200, "traces": [...]}, the
+last traces kept (see tracing.py), oldest first, optionally only the limit last
+ones lasting at least min_duration seconds. Each one has its "trace_id", its
+"start" (unix time), "duration", "attributes" and "spans", the stages with
+their "name", "start" (seconds after the accept) and "duration".
+
+Revoked grants are removed from the firewall, the journal and, with
+replication, the peer gateways. Revoking the grants of a client does not keep
+it from knocking again: revoke its certificate as well (see revoke_cert.sh).
+"""
+
+import ipaddress
+import logging
+import math
+import os
+import socket
+import threading
+
+import protocol
+import tracing
+
+logger = logging.getLogger('openme_logger')
+
+FILTER_KEYS = {'ip', 'port', 'proto', 'owner', 'all'}
+
+def parse_filter(request):
+    # Predicate on (rule, owner), from the filter of a request
+    criteria = request.get('filter', {})
+    if not isinstance(criteria, dict) or not FILTER_KEYS.issuperset(criteria):
+        raise protocol.ProtocolError(f"filter must be an object with keys among {', '.join(sorted(FILTER_KEYS))}")
+    network = None
+    if criteria.get('ip') is not None:
+        try:
+            network = ipaddress.ip_network(criteria['ip'], strict=False)
+        except (ValueError, TypeError):
+            raise protocol.ProtocolError(f"invalid ip {criteria['ip']}")
+    port = criteria.get('port')
+    proto = criteria.get('proto')
+    owner = criteria.get('owner')
+
+    def matches(rule, rule_owner):
+        if port is not None and rule.port != port:
+            return False
+        if proto is not None and rule.proto != proto:
+            return False
+        if owner is not None and rule_owner != owner:
+            return False
+        if network is not None:
+            source = ipaddress.ip_network(rule.ip, strict=False)
+            return source.version == network.version and source.subnet_of(network)
+        return True
+    return matches
+
+def in_use(path):
+    # True if a daemon accepts connections on the socket at path
+    with socket.socket(socket.AF_UNIX, socket.SOCK_STREAM) as sock:
+        try:
+            sock.connect(path)
+        except OSError:
+            return False
+    return True
+
+class AdminServer:
+    """
+    Serves the administration requests, one thread per connection. Runs where
+    the grant table is: the daemon, or its firewall writer in multi-process mode.
+    """
+
+    def __init__(self, path, grant_table):
+        self.path = path
+        self.grant_table = grant_table
+        # Left behind by a daemon that did not stop cleanly, unless it still runs
+        if os.path.exists(path):
+            if in_use(path):
+                raise RuntimeError(f"{path} is in use, is another openmed running?")
+            os.unlink(path)
+        self.sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self.sock.bind(path)
+        # Nobody can connect before listen(), so the socket is never open to others
+        os.chmod(path, 0o600)
+        self.sock.listen()
+        self.thread = threading.Thread(target=self.run, name='openmed-admin', daemon=True)
+
+    def start(self):
+        self.thread.start()
+
+    def run(self):
+        while True:
+            conn, _ = self.sock.accept()
+            threading.Thread(target=self.serve, args=(conn,), name='openmed-admin-client', daemon=True).start()
+
+    def serve(self, conn):
+        with conn:
+            reader = protocol.LineReader(conn)
+            try:
+                while (line := reader.read_line()) is not None:
+                    if line.strip():
+                        self.handle(conn, line)
+            except protocol.ProtocolError as e:
+                protocol.send_reply(conn, protocol.error_reply(str(e), e.code))
+            except OSError as e:
+                logger.error(f"Error serving an administration request: {e}")
+
+    def handle(self, conn, line):
+        request_id = None
+        try:
+            request = protocol.parse_request(line)
+            request_id = protocol.parse_request_id(request)
+            matches = parse_filter(request)
+            if request.get('op') == 'list':
+                reply = {'status': 'ok', 'code': protocol.OK, 'grants': self.list(matches)}
+            elif request.get('op') == 'trace':
+                reply = {'status': 'ok', 'code': protocol.OK, 'traces': self.traces(request)}
+            elif request.get('op') == 'revoke':
+                criteria = request.get('filter', {})
+                if not set(criteria) - {'all'} and criteria.get('all') is not True:
+                    raise protocol.ProtocolError('revoking all the grants needs the filter {"all": true}')
+                reply = {'status': 'ok', 'code': protocol.OK, 'revoked': self.revoke(matches)}
+            else:
+                raise protocol.ProtocolError(f"unknown operation {request.get('op')}")
+        except protocol.ProtocolError as e:
+            reply = protocol.error_reply(str(e), e.code)
+        except Exception as e:
+            logger.error(f"Error serving an administration request: {e}")
+            reply = protocol.error_reply("the firewall could not be updated", protocol.UNAVAILABLE)
+        protocol.send_reply(conn, reply, request_id)
+
+    def list(self, matches):
+        return [{'ip': rule.ip, 'port': rule.port, 'proto': rule.proto,
+                 'expires': None if expiry == math.inf else expiry, 'owner': owner}
+                for rule, expiry, owner in self.grant_table.snapshot() if matches(rule, owner)]
+
+    def traces(self, request):
+        limit = request.get('limit')
+        min_duration = request.get('min_duration', 0)
+        if limit is not None and (not isinstance(limit, int) or isinstance(limit, bool) or limit < 1):
+            raise protocol.ProtocolError("limit must be a positive integer")
+        if not isinstance(min_duration, (int, float)) or isinstance(min_duration, bool):
+            raise protocol.ProtocolError("min_duration must be a number of seconds")
+        return tracing.recent(limit, min_duration)
+
+    def revoke(self, matches):
+        # Only the grants as they are now: a rule granted again meanwhile stays
+        expiries = {rule: expiry for rule, expiry, owner in self.grant_table.snapshot() if matches(rule, owner)}
+        revoked = self.grant_table.revoke(expiries)
+        logger.info(f"openmed: Revoked {len(revoked)} rules on administrator request")
+        return len(revoked)
@@ -0,0 +1,213 @@
+/*
+ * XDP allowlist of the "xdp" firewall backend (see firewall.py).
+ *
+ * Packets to a protected (protocol, port), one of OPEN_PORTS, are dropped
+ * before they reach the network stack, unless their source is granted in
+ * allowed4 or allowed6. The grants are longest prefix match tries keyed by
+ * (protocol, port, source address), so a grant to a network is a single entry
+ * and a packet costs one lookup however many grants are active. The maps are
+ * pinned and updated by openmed with bpf() syscalls (see bpfmap.py).
+ *
+ * There is no connection tracking at XDP, so TCP segments without SYN are let
+ * through: established connections survive the revocation of their grant, as
+ * with the other backends, and stray segments are answered by the kernel.
+ * Fragments after the first one carry no ports and are let through as well.
+ *
+ * Build with make, which needs clang and the libbpf headers.
+ */
+
+#include <linux/bpf.h>
+#include <linux/if_ether.h>
+#include <linux/in.h>
+#include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <linux/tcp.h>
+#include <linux/udp.h>
+#include <bpf/bpf_endian.h>
+#include <bpf/bpf_helpers.h>
+
+/* Same as bpfmap.MAX_ENTRIES */
+#define MAX_ENTRIES (1 << 20)
+/* IPv6 extension headers skipped before giving up on finding the ports */
+#define MAX_EXTENSION_HEADERS 4
+
+struct vlan_header {
+    __be16 tci;
+    __be16 encapsulated_proto;
+};
+
+/* Keys as packed by firewall.XdpBackend. The prefix length counts the bits of
+ * proto, pad and port, so they always match exactly. */
+struct allowed4_key {
+    __u32 prefixlen;
+    __u8 proto;
+    __u8 pad;
+    __be16 port;
+    __be32 addr;
+};
+
+struct allowed6_key {
+    __u32 prefixlen;
+    __u8 proto;
+    __u8 pad;
+    __be16 port;
+    struct in6_addr addr;
+};
+
+struct protected_key {
+    __u8 proto;
+    __u8 pad;
+    __be16 port;
+};
+
+struct {
+    __uint(type, BPF_MAP_TYPE_LPM_TRIE);
+    __type(key, struct allowed4_key);
+    __type(value, __u8);
+    __uint(max_entries, MAX_ENTRIES);
+    __uint(map_flags, BPF_F_NO_PREALLOC);
+} allowed4 SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_LPM_TRIE);
+    __type(key, struct allowed6_key);
+    __type(value, __u8);
+    __uint(max_entries, MAX_ENTRIES);
+    __uint(map_flags, BPF_F_NO_PREALLOC);
+} allowed6 SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_HASH);
+    __type(key, struct protected_key);
+    __type(value, __u8);
+    __uint(max_entries, 65536 * 2);
+} protected SEC(".maps");
+
+/* Destination port of the TCP or UDP header at l4, 0 to let the packet through */
+static __always_inline __be16 destination_port(void *l4, void *end, __u8 proto)
+{
+    if (proto == IPPROTO_TCP) {
+        struct tcphdr *tcp = l4;
+
+        if ((void *)(tcp + 1) > end)
+            return 0;
+        /* Segments of established connections */
+        if (!tcp->syn)
+            return 0;
+        return tcp->dest;
+    }
+    if (proto == IPPROTO_UDP) {
+        struct udphdr *udp = l4;
+
+        if ((void *)(udp + 1) > end)
+            return 0;
+        return udp->dest;
+    }
+    return 0;
+}
+
+static __always_inline int is_protected(__u8 proto, __be16 port)
+{
+    struct protected_key key = { .proto = proto, .port = port };
+
+    return port && bpf_map_lookup_elem(&protected, &key);
+}
+
+static __always_inline int filter_ipv4(void *l3, void *end)
+{
+    struct iphdr *ip = l3;
+    struct allowed4_key key = {};
+    __be16 port;
+
+    if ((void *)(ip + 1) > end || ip->ihl < 5)
+        return XDP_PASS;
+    /* Only the first fragment has the ports */
+    if (ip->frag_off & bpf_htons(0x1fff))
+        return XDP_PASS;
+    port = destination_port(l3 + ip->ihl * 4, end, ip->protocol);
+    if (!is_protected(ip->protocol, port))
+        return XDP_PASS;
+
+    key.prefixlen = 32 + 32;
+    key.proto = ip->protocol;
+    key.port = port;
+    key.addr = ip->saddr;
+    return bpf_map_lookup_elem(&allowed4, &key) ? XDP_PASS : XDP_DROP;
+}
+
+static __always_inline int filter_ipv6(void *l3, void *end)
+{
+    struct ipv6hdr *ip = l3;
+    struct allowed6_key key = {};
+    void *l4 = ip + 1;
+    __u8 proto;
+    __be16 port;
+    int i;
+
+    if ((void *)(ip + 1) > end)
+        return XDP_PASS;
+    proto = ip->nexthdr;
+    /* Skip the extension headers in front of TCP or UDP */
+#pragma unroll
+    for (i = 0; i < MAX_EXTENSION_HEADERS; i++) {
+        if (proto == IPPROTO_HOPOPTS || proto == IPPROTO_ROUTING || proto == IPPROTO_DSTOPTS) {
+            __u8 *header = l4;
+
+            if ((void *)(header + 2) > end)
+                return XDP_PASS;
+            proto = header[0];
+            l4 += (header[1] + 1) * 8;
+        } else if (proto == IPPROTO_FRAGMENT) {
+            __u8 *header = l4;
+
+            if ((void *)(header + 8) > end)
+                return XDP_PASS;
+            /* Only the first fragment has the ports */
+            if (((header[2] << 8) | header[3]) & 0xfff8)
+                return XDP_PASS;
+            proto = header[0];
+            l4 += 8;
+        } else {
+            break;
+        }
+    }
+    port = destination_port(l4, end, proto);
+    if (!is_protected(proto, port))
+        return XDP_PASS;
+
+    key.prefixlen = 32 + 128;
+    key.proto = proto;
+    key.port = port;
+    key.addr = ip->saddr;
+    return bpf_map_lookup_elem(&allowed6, &key) ? XDP_PASS : XDP_DROP;
+}
+
+SEC("xdp")
+int openme_xdp(struct xdp_md *ctx)
+{
+    void *data = (void *)(long)ctx->data;
+    void *end = (void *)(long)ctx->data_end;
+    struct ethhdr *eth = data;
+    void *l3 = eth + 1;
+    __be16 proto;
+
+    if ((void *)(eth + 1) > end)
+        return XDP_PASS;
+    proto = eth->h_proto;
+    /* One 802.1Q or 802.1ad tag */
+    if (proto == bpf_htons(ETH_P_8021Q) || proto == bpf_htons(ETH_P_8021AD)) {
+        struct vlan_header *vlan = l3;
+
+        if ((void *)(vlan + 1) > end)
+            return XDP_PASS;
+        proto = vlan->encapsulated_proto;
+        l3 = vlan + 1;
+    }
+    if (proto == bpf_htons(ETH_P_IP))
+        return filter_ipv4(l3, end);
+    if (proto == bpf_htons(ETH_P_IPV6))
+        return filter_ipv6(l3, end);
+    return XDP_PASS;
+}
+
+char LICENSE[] SEC("license") = "GPL";
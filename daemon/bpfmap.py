@@ -0,0 +1,107 @@
+"""
+BPF maps, through the bpf() system call, for the "xdp" firewall backend.
+
+Only what the backend needs: creating and pinning a map, opening a pinned one,
+and updating, deleting and listing its elements. Each update is one system
+call, without spawning anything, so a grant is in the kernel within
+microseconds. Keys and values are bytes, laid out as in bpf/openme_xdp.c.
+"""
+
+import ctypes
+import os
+import platform
+import struct
+
+# Numbers of the bpf() system call
+SYS_BPF = {'x86_64': 321, 'aarch64': 280, 'armv7l': 386, 'armv6l': 386, 'i686': 357, 'riscv64': 280}
+
+# Commands
+BPF_MAP_CREATE = 0
+BPF_MAP_UPDATE_ELEM = 2
+BPF_MAP_DELETE_ELEM = 3
+BPF_MAP_GET_NEXT_KEY = 4
+BPF_OBJ_PIN = 6
+BPF_OBJ_GET = 7
+
+# Map types and flags
+BPF_MAP_TYPE_HASH = 1
+BPF_MAP_TYPE_LPM_TRIE = 11
+BPF_F_NO_PREALLOC = 1
+
+# Largest number of elements of the maps, the same as in bpf/openme_xdp.c
+MAX_ENTRIES = 1 << 20
+
+libc = ctypes.CDLL(None, use_errno=True)
+
+def bpf(command, attr):
+    # Run a bpf() command with attr, a bytes-like bpf_attr. Returns its result.
+    buffer = ctypes.create_string_buffer(bytes(attr), len(attr))
+    result = libc.syscall(SYS_BPF[platform.machine()], command, buffer, len(attr))
+    if result < 0:
+        error = ctypes.get_errno()
+        raise OSError(error, f"bpf command {command} failed: {os.strerror(error)}")
+    return result
+
+def address(buffer):
+    return ctypes.addressof(buffer) if buffer is not None else 0
+
+class BpfMap:
+
+    def __init__(self, fd, key_size, value_size):
+        self.fd = fd
+        self.key_size = key_size
+        self.value_size = value_size
+
+    @classmethod
+    def create(cls, name, map_type, key_size, value_size, max_entries=MAX_ENTRIES, flags=0):
+        # map_type, key_size, value_size, max_entries, map_flags, inner_map_fd, numa_node, map_name
+        attr = struct.pack('=7I16s', map_type, key_size, value_size, max_entries, flags, 0, 0, name.encode()[:15])
+        return cls(bpf(BPF_MAP_CREATE, attr), key_size, value_size)
+
+    @classmethod
+    def pinned(cls, path, key_size, value_size):
+        # The map pinned at path, in the BPF filesystem
+        path_buffer = ctypes.create_string_buffer(path.encode())
+        attr = struct.pack('=QII', address(path_buffer), 0, 0)
+        return cls(bpf(BPF_OBJ_GET, attr), key_size, value_size)
+
+    def pin(self, path):
+        path_buffer = ctypes.create_string_buffer(path.encode())
+        bpf(BPF_OBJ_PIN, struct.pack('=QII', address(path_buffer), self.fd, 0))
+
+    def element_attr(self, key, value=None):
+        # map_fd, key and value pointers, flags. The buffers must outlive the call
+        key_buffer = ctypes.create_string_buffer(key, self.key_size)
+        value_buffer = None if value is None else ctypes.create_string_buffer(value, self.value_size)
+        attr = struct.pack('=IxxxxQQQ', self.fd, address(key_buffer), address(value_buffer), 0)
+        return attr, (key_buffer, value_buffer)
+
+    def update(self, key, value):
+        attr, buffers = self.element_attr(key, value)
+        bpf(BPF_MAP_UPDATE_ELEM, attr)
+
+    def delete(self, key):
+        # Returns False if the key was not in the map
+        attr, buffers = self.element_attr(key)
+        try:
+            bpf(BPF_MAP_DELETE_ELEM, attr)
+        except FileNotFoundError:
+            return False
+        return True
+
+    def keys(self):
+        # All the keys of the map. Elements deleted meanwhile may be skipped.
+        keys = []
+        key_buffer = None
+        next_buffer = ctypes.create_string_buffer(self.key_size)
+        while True:
+            attr = struct.pack('=IxxxxQQQ', self.fd, address(key_buffer), address(next_buffer), 0)
+            try:
+                bpf(BPF_MAP_GET_NEXT_KEY, attr)
+            except FileNotFoundError:
+                return keys
+            keys.append(next_buffer.raw)
+            key_buffer = ctypes.create_string_buffer(next_buffer.raw, self.key_size)
+
+    def close(self):
+        os.close(self.fd)
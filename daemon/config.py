@@ -5,11 +5,65 @@ LISTENING_PORT = 54154 # SALSA
 Port the server will be listening. Defaults 54154 (SALSA)
 """
 
+LISTEN_ADDRESS = "::"
+"""
+Address the server listens on, for both the TLS and the SPA knocks. "::" is
+dual-stack: clients connect over IPv6 or IPv4. On a host without IPv6
+(ipv6.disable=1) it falls back to "0.0.0.0", which only accepts IPv4.
+"""
+
+LISTEN_BACKLOG = 128
+"""
+Maximum number of pending connections the kernel queues on the listening
+socket before it starts dropping SYNs. Raise it if many clients knock at once.
+"""
+
+WORKER_THREADS = 16
+"""
+Number of threads handling client connections concurrently. A slow or stalled
+client only holds up its own worker, not the accept loop.
+"""
+
+WORKER_PROCESSES = 1
+"""
+Number of worker processes. With more than one, each worker binds its own
+socket to LISTENING_PORT with SO_REUSEPORT, so the kernel spreads the
+connections, and their TLS handshakes, across the cores. A separate process
+applies all the firewall updates. Each worker runs WORKER_THREADS threads. On
+SIGHUP, or when the CRL changes, the workers are replaced by new ones.
+"""
+
+WORKER_QUEUE_SIZE = 1024
+"""
+Maximum number of accepted connections waiting for a free worker. When the
+queue is full new connections are closed right away.
+"""
+
 OPEN_PORTS = [80,443]
 """
 Array of ports that will be opened
 """
 
+POLICIES = {
+    # "CN=client1": {"ports": [443], "protos": ["tcp"], "ttl": 600, "third_party": False},
+    # "OU=ops": {"protos": ["tcp"]},
+}
+"""
+What each client may open, by the common name (CN=) or organizational unit
+(OU=) of its certificate, the common name first (see policy.py). A policy can
+restrict the ports, among OPEN_PORTS, and the protocols, set the TTL of the
+grants in seconds (above 0) instead of GRANT_TTL, and forbid opening the ports
+to any other address than the client's own (third_party, True or False). Keys
+left out allow everything. Opening only the needed
+protocols, usually tcp, halves the firewall updates.
+"""
+
+DEFAULT_POLICY = {}
+"""
+Policy of the clients that match none of POLICIES, {} for all of OPEN_PORTS in
+tcp and udp, for GRANT_TTL, to any address. None rejects them.
+"""
+
 #CERT_FILE = "/etc/openme/certificate.crt"
 CERT_FILE = "../certs/server.crt"
 """
@@ -28,4 +82,373 @@ Certification authority (CA) root certificate. Only clients that have connected
 to the server using a certificate issued by this authority will go through.
 """
 
-DEBUG=True
\ No newline at end of file
+#CRL_FILE = "/etc/openme/crl.pem"
+CRL_FILE = None
+"""
+Certificate revocation list (CRL) of the CA, as created by setup_ca.sh and
+revoke_cert.sh (e.g. "../certs/crl.pem"). Clients with a revoked certificate
+are rejected during the handshake. None disables the check. The daemon does not
+start if the file is set but cannot be loaded, and clients are rejected once
+the CRL is past its next update date.
+"""
+
+CRL_RELOAD_INTERVAL = 10
+"""
+Seconds between checks of CRL_FILE for changes. A changed CRL is loaded into a
+new TLS context without a restart. Sessions started before the change cannot
+be resumed afterwards. In multi-process mode the master reloads it and replaces
+the workers, so they keep sharing the session ticket keys.
+"""
+
+GRANT_TTL = 3600
+"""
+Seconds the ports stay open after a knock. Knocking again before the grant
+expires extends it. Set it to None to keep the ports open forever.
+"""
+
+GRANT_JOURNAL = "grants.db"
+"""
+SQLite database where the grants and their expiries are recorded (see
+journal.py), e.g. "/var/lib/openme/grants.db". At startup, the grants are
+recovered from it and reconciled with the live firewall, so they expire when
+they were meant to. None disables it: the rules found in the firewall are then
+granted again for GRANT_TTL.
+"""
+
+GRANT_JOURNAL_COMPACT_INTERVAL = 300
+"""
+Seconds between two compactions of the grant journal, which fold its
+write-ahead log into the database.
+"""
+
+#ADMIN_SOCKET = "/run/openme/admin.sock"
+ADMIN_SOCKET = "openmed.sock"
+"""
+Unix socket where openmectl.py lists and revokes the grants. It is created
+readable and writable by the user of the daemon only. None disables it.
+"""
+
+GRANT_EXPIRY_RESOLUTION = 1
+"""
+Seconds a grant may outlive its expiry, so that the grants expiring within the
+same interval are revoked in one firewall commit.
+"""
+
+TLS_CIPHERS = "ECDHE+AESGCM:ECDHE+CHACHA20"
+"""
+OpenSSL cipher list for TLS 1.2 connections. Only ECDHE key exchanges are
+allowed, so no finite field Diffie-Hellman is ever computed. It works with both
+RSA and EC (setup_ca.sh ec) certificates. TLS 1.3 always uses (EC)DHE.
+"""
+
+TLS_SESSION_TICKETS = 2
+"""
+Number of TLS 1.3 session tickets sent to the clients after a full handshake.
+Clients that present a ticket on their next connection resume the session and
+skip the certificate exchange. Set it to 0 to disable tickets.
+"""
+
+RATE_LIMIT_RATE = None
+"""
+Connections per second allowed from each source address, checked right after
+accepting the connection and before the TLS handshake, and SPA knocks per
+second. Connections over the rate are reset. None, the default, disables the
+limit. E.g. 1 stops a single address from flooding the handshakes, but clients
+behind the same NAT share its budget, so leave room for them in
+RATE_LIMIT_BURST.
+"""
+
+RATE_LIMIT_BURST = 10
+"""
+Connections a source can open in a burst before RATE_LIMIT_RATE applies.
+"""
+
+RATE_LIMIT_MAX_SOURCES = 100000
+"""
+Maximum number of source addresses tracked by the rate limiter. The least
+recently seen ones are forgotten first.
+"""
+
+MAX_PENDING_HANDSHAKES = 64
+"""
+Maximum number of connections accepted and not yet done with their TLS
+handshake, in the worker queue or in a handshake. Connections beyond it are
+reset, so a flood of handshakes cannot hold back the knocks already accepted.
+"""
+
+SPA_PORT = None
+"""
+UDP port for single packet authorization (SPA) knocks, which open the ports
+with one authenticated and encrypted datagram instead of a TLS connection.
+None disables it. For example: 54154
+The source address of an "OPEN ME" datagram is not authenticated: an on-path
+observer can replay a captured knock from their own address before the
+original arrives, get the grant, and have the original rejected as a replay.
+See SPA_REQUIRE_ADDRESS.
+"""
+
+SPA_REQUIRE_ADDRESS = False
+"""
+Only accept the SPA knocks that name an address, "OPEN <ip>", which is
+authenticated, and whose source is within it. A captured knock replayed from
+another address is then rejected. The clients must knock with -i and their
+address as the daemon sees it, e.g. their public address behind a NAT.
+"""
+
+SPA_KEYS_DIR = "../certs"
+"""
+Directory with the SPA keys of the clients, one NAME.spa file per client
+(created by add_cert.sh). Keys added or removed are picked up within
+SPA_KEYS_RELOAD_INTERVAL, or at once on SIGHUP.
+"""
+
+SPA_KEYS_RELOAD_INTERVAL = 10
+"""
+Seconds between checks of the key files of SPA_KEYS_DIR for changes, with or
+without knocks coming in. Keys added, removed or written, e.g. the one removed
+by revoke_cert.sh, are loaded without a restart. None only loads them at
+startup and on SIGHUP.
+"""
+
+SPA_MAX_CLOCK_SKEW = 30
+"""
+Maximum difference in seconds between the clock of the client and the clock of
+the daemon for an SPA knock to be accepted.
+"""
+
+PEER_PORT = None
+"""
+TCP port where the peer gateways connect to send their grants (see
+replication.py). None does not accept any. For example: 54155
+"""
+
+PEERS = []
+"""
+Peer gateways to send the grants to, as "host:port" (e.g. ["gw2.example.com:54155"]).
+Every gateway usually lists all the others, and a knock on any of them opens the
+ports on all of them.
+"""
+
+PEER_NAMES = []
+"""
+Common names of the certificates of the peers, created with add_peer.sh. Peer
+connections with any other certificate are rejected, both ways.
+"""
+
+#PEER_CERT_FILE = "/etc/openme/peer.crt"
+#PEER_KEY_FILE = "/etc/openme/peer.key"
+PEER_CERT_FILE = "../certs/peer.crt"
+PEER_KEY_FILE = "../certs/peer.key"
+"""
+Certificate and key of this gateway for the peer connections. They must be
+usable both as client and as server certificates (add_peer.sh, with easyrsa's
+serverClient type).
+"""
+
+PEER_RESYNC_INTERVAL = 60
+"""
+Seconds between two full exchanges of the active grants with each peer. They
+make up for the grants missed while a peer was unreachable.
+"""
+
+PEER_QUEUE_SIZE = 10000
+"""
+Maximum number of grants waiting to be sent to a peer. When it is full, the
+grants are dropped and reach the peer with the next resync.
+"""
+
+MAX_REQUEST_SIZE = 65536
+"""
+Maximum size in bytes of a JSON request (see protocol.py).
+"""
+
+BULK_MAX_RULES = 10000
+"""
+Maximum number of rules (targets x ports x protocols) a single bulk request
+can open.
+"""
+
+BULK_MIN_PREFIXLEN = 16
+"""
+IPv4 networks in a bulk request cannot be wider than this prefix length.
+"""
+
+BULK_MIN_PREFIXLEN6 = 48
+"""
+IPv6 networks in a bulk request cannot be wider than this prefix length.
+"""
+
+HANDSHAKE_TIMEOUT = 5
+"""
+Seconds a client has to complete the TLS handshake once its TCP connection
+has been accepted. Clients that take longer are disconnected.
+"""
+
+READ_TIMEOUT = 5
+"""
+Seconds a client has to send its command after the TLS handshake.
+"""
+
+KEEPALIVE_IDLE_TIMEOUT = 300
+"""
+Seconds a persistent connection (a JSON request with "keepalive": true, see
+protocol.py) may stay idle between two requests before it is closed. Clients
+send their heartbeats more often than this.
+"""
+
+KEEPALIVE_MAX_CONNECTIONS = 10000
+"""
+Maximum number of idle persistent connections. Connections beyond it are
+closed once their request is served. 0 disables the persistent connections.
+"""
+
+FIREWALL_BACKEND = "iptables-restore"
+"""
+How rules are applied to the firewall:
+ - "iptables": one iptables process per rule.
+ - "iptables-restore": all the rules of a commit in one iptables-restore --noflush transaction.
+ - "ipset": grants are kept in an ipset matched by a single iptables ACCEPT rule.
+ - "nft-set": grants are kept in an nftables set. openme creates its own table
+   that drops traffic to OPEN_PORTS unless the source is in the set.
+ - "xdp": grants are kept in BPF maps checked by an XDP program on
+   XDP_INTERFACES, which drops traffic to OPEN_PORTS unless the source is
+   granted, before netfilter. Grants are applied with bpf() system calls. Needs
+   bpftool, and the program built with make in daemon/bpf.
+ - "stub": does not touch the firewall. For benchmarks only.
+The set based backends keep the packet path at one lookup whatever the number
+of grants, while the iptables ones append rules to IPTABLES_CHAIN. All of them
+handle IPv6 grants too: with ip6tables, in a second ipset (IPSET_NAME followed
+by 6), in the allowed6 nftables set and in the allowed6 BPF map.
+"""
+
+IPTABLES_CHAIN = "OPENME"
+"""
+Chain of the rules of the "iptables" and "iptables-restore" backends, created
+and jumped to from the top of INPUT by openmed. The rules are commented
+"openme". The journaled grants that earlier versions added to INPUT are moved
+to it at startup. Rules without the comment, e.g. added by hand, are never touched.
+"""
+
+IPSET_NAME = "openme"
+"""
+Name of the ipset used by the "ipset" backend.
+"""
+
+NFT_TABLE = "openme"
+"""
+Name of the inet table created by the "nft-set" backend.
+"""
+
+XDP_INTERFACES = ["eth0"]
+"""
+Interfaces the "xdp" backend attaches its program to.
+"""
+
+XDP_MODE = "xdp"
+"""
+How bpftool attaches the program: "xdp" lets the kernel choose, "xdpdrv" needs
+support from the network driver, "xdpgeneric" works with any interface but
+runs later in the receive path, "xdpoffload" runs it on the NIC.
+"""
+
+BPF_OBJECT = "bpf/openme_xdp.o"
+"""
+The XDP program of the "xdp" backend, built by make in daemon/bpf.
+"""
+
+BPF_PIN_DIR = "/sys/fs/bpf/openme"
+"""
+Where the "xdp" backend pins its program and maps, in the BPF filesystem. The
+maps, and the grants in them, are kept across restarts of the daemon. To remove
+the filter: bpftool net detach xdp dev eth0, and rm -r this directory.
+"""
+
+FIREWALL_BATCH_WINDOW = 0.01
+"""
+Seconds the firewall thread waits for more grants after receiving one, so the
+grants that arrive together are applied in a single commit.
+"""
+
+FIREWALL_BATCH_MAX_UPDATES = 256
+"""
+Maximum number of grants applied in a single firewall commit.
+"""
+
+FIREWALL_GC_INTERVAL = 300
+"""
+Seconds between two garbage collections of the rules of the iptables backends:
+the duplicated rules, and the ones not granted any more, e.g. after a failed
+revocation, are removed in a single iptables-restore transaction. A rule not
+granted is removed once found by two collections in a row, so up to twice this
+after it should have been. 0 disables the collection.
+"""
+
+METRICS_PORT = None
+"""
+Port of the HTTP listener that exports the metrics in the Prometheus format
+at /metrics. None disables it. For example: 9154
+With WORKER_PROCESSES > 1, every process exports its own metrics: the firewall
+writer on METRICS_PORT and worker i on METRICS_PORT + 1 + i.
+"""
+
+METRICS_ADDRESS = "127.0.0.1"
+"""
+Address the metrics listener binds to.
+"""
+
+TRACE_SAMPLE_RATE = 0.01
+"""
+Share of the knocks whose trace, the time spent in each stage from accept to
+reply, is kept (see tracing.py). 0 keeps only the slow ones.
+"""
+
+TRACE_SLOW_THRESHOLD = 1
+"""
+Seconds after which the trace of a knock is kept, sampled or not. Every knock
+is then timed, which costs a few microseconds. None disables it.
+"""
+
+TRACE_BUFFER_SIZE = 1000
+"""
+Number of traces kept in memory, dumped with openmectl.py trace.
+"""
+
+TRACE_OTLP_ENDPOINT = None
+"""
+URL of an OpenTelemetry collector the traces are also sent to, with OTLP/HTTP
+and JSON. None disables it. For example: "http://localhost:4318/v1/traces"
+"""
+
+LOG_BACKEND = "syslog"
+"""
+Where the logs are written:
+ - "syslog": to the syslog socket at SYSLOG_ADDRESS
+ - "journald": to the systemd journal
+ - "file": appended to LOG_FILE
+ - "stderr": to the standard error
+Records are written by a background thread, so a slow backend never blocks
+the knocks.
+"""
+
+SYSLOG_ADDRESS = "/dev/log"
+"""
+Syslog socket used by the "syslog" log backend.
+"""
+
+LOG_FILE = "/var/log/openmed.log"
+"""
+File used by the "file" log backend.
+"""
+
+LOG_QUEUE_SIZE = 10000
+"""
+Maximum number of log records waiting to be written. When the backend falls
+behind and the queue is full, new records are dropped and counted.
+"""
+
+LOG_BATCH_SIZE = 100
+"""
+Maximum number of log records written at once by the logging thread.
+"""
+
+DEBUG=True
@@ -0,0 +1,548 @@
+"""
+Firewall backends used by openmed to open (and close) ports.
+
+A rule is a (ip_address, port, protocol) tuple, where the address may be IPv4 or
+IPv6. Backends receive lists of rules to add and remove, and apply them in as
+few kernel transactions as possible.
+The FirewallCommitter sits in front of the backend and coalesces the grants
+that arrive within a short window into a single commit.
+"""
+
+import ipaddress
+import json
+import logging
+import os
+import queue
+import struct
+import subprocess
+import threading
+import time
+from collections import namedtuple
+from concurrent.futures import Future
+
+import bpfmap
+import config
+import metrics
+
+logger = logging.getLogger('openme_logger')
+
+Rule = namedtuple('Rule', ['ip', 'port', 'proto'])
+
+def normalize_source(source):
+    # Sources are kept as plain addresses, and networks only when they are wider
+    # than a single host (firewall listings show 1.2.3.4 as 1.2.3.4/32). IPv4
+    # clients of a dual-stack socket (::ffff:1.2.3.4) are IPv4 addresses.
+    network = ipaddress.ip_network(source, strict=False)
+    if network.num_addresses == 1:
+        address = network.network_address
+        return str(getattr(address, 'ipv4_mapped', None) or address)
+    return network.with_prefixlen
+
+def is_ipv6(rule):
+    return ':' in rule.ip
+
+def split_families(rules):
+    # The IPv4 and the IPv6 rules, which go to different tables or sets
+    ipv4 = [rule for rule in rules if not is_ipv6(rule)]
+    ipv6 = [rule for rule in rules if is_ipv6(rule)]
+    return ipv4, ipv6
+
+# Comment of the rules added by openme to the iptables chain
+RULE_COMMENT = 'openme'
+
+def iptables_rule_spec(rule):
+    # Match specification of the ACCEPT rule for a single (ip, port, proto)
+    return ['-p', rule.proto, '-s', rule.ip, '--dport', str(rule.port), '-m', 'comment', '--comment', RULE_COMMENT, '-j', 'ACCEPT']
+
+def legacy_rule_spec(rule):
+    # Specification of the rules added to INPUT by the versions without a chain
+    return ['-p', rule.proto, '-s', rule.ip, '--dport', str(rule.port), '-j', 'ACCEPT']
+
+def iptables_command(rule):
+    # iptables for the IPv4 rules, ip6tables for the IPv6 ones
+    return 'ip6tables' if is_ipv6(rule) else 'iptables'
+
+class FirewallBackend:
+    """
+    Base class of the firewall backends. Subclasses implement apply().
+    """
+    name = None
+
+    def setup(self):
+        # Prepare whatever the backend needs in the kernel. Called once at startup.
+        pass
+
+    def apply(self, add, remove):
+        # Add and remove the given rules. Raises an exception on failure.
+        raise NotImplementedError
+
+    def list_rules(self):
+        # Rules currently in the firewall, so the grants survive a restart
+        return []
+
+    def migrate(self, rules):
+        # Take over the rules that earlier versions added to the firewall, among
+        # rules, the ones journaled as granted. Called once, at startup.
+        pass
+
+    def collect_garbage(self, active, suspects):
+        # Remove the rules of the firewall that are duplicated or not in active,
+        # the rules granted. Rules not granted are only removed once found by
+        # two passes in a row, so that a revocation in flight is not done
+        # twice. Returns the rules found that are left for the next pass, the
+        # suspects of that pass. Backends that cannot leak rules do nothing.
+        return set()
+
+    def run(self, args, script=None, check=True):
+        # Run a firewall command, feeding it the script through stdin if any.
+        # In DEBUG mode, the command is only logged. With check=False, returns
+        # None instead of raising when the command fails.
+        if config.DEBUG:
+            logger.info(' '.join(args))
+            if script:
+                logger.info(script)
+            return ''
+        result = subprocess.run(args, input=script, text=True, capture_output=True)
+        if result.returncode != 0:
+            if not check:
+                return None
+            raise RuntimeError(f"{args[0]} failed: {result.stderr.strip()}")
+        return result.stdout
+
+class IptablesBackend(FirewallBackend):
+    """
+    Runs one iptables (or ip6tables) process per rule. Slow, but works everywhere.
+
+    The rules are ACCEPT rules commented "openme" in a chain of their own,
+    IPTABLES_CHAIN, jumped to from INPUT, so they are easy to tell apart and
+    INPUT stays short. The rules left behind, e.g. by a revocation that
+    failed, and the duplicates are removed by collect_garbage() in a single
+    iptables-restore transaction. Only the rules commented "openme" are ever
+    collected: the ones added by hand, in INPUT or in the chain, are left alone.
+    """
+    name = 'iptables'
+
+    def setup(self):
+        for command in ('iptables', 'ip6tables'):
+            # Create the chain and jump to it, unless done by a previous run
+            if self.run([command, '-S', config.IPTABLES_CHAIN], check=False) is None:
+                self.run([command, '-N', config.IPTABLES_CHAIN])
+            jump = ['INPUT', '-j', config.IPTABLES_CHAIN]
+            if self.run([command, '-C'] + jump, check=False) is None:
+                self.run([command, '-I'] + jump)
+
+    def migrate(self, rules):
+        for command in ('iptables', 'ip6tables'):
+            self.migrate_chain(command, rules)
+
+    def migrate_chain(self, command, rules):
+        # Move the rules added to INPUT by the versions without a chain into
+        # the chain, in one transaction, so they expire like the others. Only
+        # the journaled ones: an uncommented rule could have been added by hand.
+        legacy = [rule for rule in self.list_chain_rules(command, 'INPUT', comment=None) if rule in rules]
+        if legacy:
+            logger.info(f"openmed: Moving {len(legacy)} rules from INPUT to {config.IPTABLES_CHAIN}")
+            lines = ['*filter']
+            lines += [' '.join(['-D', 'INPUT'] + legacy_rule_spec(rule)) for rule in legacy]
+            lines += [' '.join(['-A', config.IPTABLES_CHAIN] + iptables_rule_spec(rule)) for rule in legacy]
+            lines += ['COMMIT', '']
+            self.run([command + '-restore', '--noflush'], '\n'.join(lines))
+
+    def list_rules(self):
+        return list(dict.fromkeys(self.list_chain_rules('iptables') + self.list_chain_rules('ip6tables')))
+
+    def list_chain_rules(self, command, chain=None, comment=RULE_COMMENT):
+        # Parse the ACCEPT rules for OPEN_PORTS with the comment (without any
+        # if None) out of iptables -S, in order and with the duplicates, e.g.
+        # -A OPENME -s 1.2.3.4/32 -p tcp -m tcp --dport 80 -m comment --comment openme -j ACCEPT
+        chain = chain or config.IPTABLES_CHAIN
+        rules = []
+        for line in (self.run([command, '-S', chain], check=False) or '').splitlines():
+            args = line.split()
+            if args[:2] != ['-A', chain] or args[-2:] != ['-j', 'ACCEPT']:
+                continue
+            try:
+                source = args[args.index('-s') + 1]
+                proto = args[args.index('-p') + 1]
+                port = int(args[args.index('--dport') + 1])
+                rule_comment = args[args.index('--comment') + 1].strip('"') if '--comment' in args else None
+            except (ValueError, IndexError):
+                continue
+            if port in config.OPEN_PORTS and proto in ('tcp', 'udp') and rule_comment == comment:
+                rules.append(Rule(normalize_source(source), port, proto))
+        return rules
+
+    def collect_garbage(self, active, suspects):
+        found = set()
+        for command in ('iptables', 'ip6tables'):
+            stale = []
+            seen = set()
+            for rule in self.list_chain_rules(command):
+                # Every copy after the first one is a duplicate
+                if rule in seen:
+                    stale.append(rule)
+                    continue
+                seen.add(rule)
+                if rule not in active:
+                    found.add(rule)
+                    if rule in suspects:
+                        stale.append(rule)
+            if stale:
+                logger.info(f"openmed: Removing {len(stale)} stale rules from {config.IPTABLES_CHAIN}")
+                lines = ['*filter']
+                lines += [' '.join(['-D', config.IPTABLES_CHAIN] + iptables_rule_spec(rule)) for rule in stale]
+                lines += ['COMMIT', '']
+                self.run([command + '-restore', '--noflush'], '\n'.join(lines))
+                metrics.firewall_rules_total.inc(len(stale), action='collect')
+                found -= set(stale)
+        return found
+
+    def apply(self, add, remove):
+        for rule in add:
+            self.run([iptables_command(rule), '-A', config.IPTABLES_CHAIN] + iptables_rule_spec(rule))
+        for rule in remove:
+            self.run([iptables_command(rule), '-D', config.IPTABLES_CHAIN] + iptables_rule_spec(rule))
+
+class IptablesRestoreBackend(IptablesBackend):
+    """
+    Applies all the rules in a single iptables-restore --noflush transaction,
+    so a commit costs one fork/exec and one xtables lock whatever its size. The
+    IPv6 rules go in a second transaction, to ip6tables-restore.
+    """
+    name = 'iptables-restore'
+
+    def apply(self, add, remove):
+        add4, add6 = split_families(add)
+        remove4, remove6 = split_families(remove)
+        self.restore('iptables-restore', add4, remove4)
+        self.restore('ip6tables-restore', add6, remove6)
+
+    def restore(self, command, add, remove):
+        if not add and not remove:
+            return
+        lines = ['*filter']
+        lines += [' '.join(['-A', config.IPTABLES_CHAIN] + iptables_rule_spec(rule)) for rule in add]
+        lines += [' '.join(['-D', config.IPTABLES_CHAIN] + iptables_rule_spec(rule)) for rule in remove]
+        lines += ['COMMIT', '']
+        self.run([command, '--noflush'], '\n'.join(lines))
+
+class IpsetBackend(FirewallBackend):
+    """
+    Keeps the authorized (source, protocol:port) pairs in a hash:net,port ipset
+    matched by a single iptables ACCEPT rule, so the packet path costs one set
+    lookup however many grants are active. IPv6 grants are kept in a second,
+    inet6, set (IPSET_NAME followed by 6) matched by ip6tables. Updates to both
+    sets go in one ipset restore.
+    """
+    name = 'ipset'
+
+    def setup(self):
+        # Create the sets and the rules that match them, unless they already exist
+        for command, family, name in [('iptables', 'inet', config.IPSET_NAME), ('ip6tables', 'inet6', self.set_name6())]:
+            self.run(['ipset', 'create', name, 'hash:net,port', 'family', family, '-exist'])
+            match = ['INPUT', '-m', 'set', '--match-set', name, 'src,dst', '-j', 'ACCEPT']
+            if self.run([command, '-C'] + match, check=False) is None:
+                self.run([command, '-I'] + match)
+
+    def set_name6(self):
+        return config.IPSET_NAME + '6'
+
+    def set_name(self, rule):
+        return self.set_name6() if is_ipv6(rule) else config.IPSET_NAME
+
+    def apply(self, add, remove):
+        if not add and not remove:
+            return
+        lines = [f"add {self.set_name(rule)} {rule.ip},{rule.proto}:{rule.port}" for rule in add]
+        lines += [f"del {self.set_name(rule)} {rule.ip},{rule.proto}:{rule.port}" for rule in remove]
+        lines += ['']
+        self.run(['ipset', 'restore', '-exist'], '\n'.join(lines))
+
+    def list_rules(self):
+        return self.list_set_rules(config.IPSET_NAME) + self.list_set_rules(self.set_name6())
+
+    def list_set_rules(self, name):
+        # Parse the members of the set, saved as "add openme 1.2.3.4,tcp:80"
+        rules = []
+        for line in self.run(['ipset', 'save', name]).splitlines():
+            args = line.split()
+            if len(args) != 3 or args[0] != 'add':
+                continue
+            source, _, service = args[2].partition(',')
+            proto, _, port = service.partition(':')
+            rules.append(Rule(normalize_source(source), int(port), proto))
+        return rules
+
+class NftSetBackend(FirewallBackend):
+    """
+    Keeps the authorized (source . protocol . port) elements in an nftables set
+    in a table owned by openme. Its input chain drops traffic to the opened
+    ports unless the source is in the set, so it does not rely on any other
+    ruleset. IPv4 and IPv6 grants are kept in the allowed4 and allowed6 sets of
+    the same inet table. All the elements of a commit are applied in one nft
+    transaction.
+    """
+    name = 'nft-set'
+
+    def setup(self):
+        table = f"inet {config.NFT_TABLE}"
+        protected = ', '.join(f"{proto} . {port}" for port in config.OPEN_PORTS for proto in ('tcp', 'udp'))
+        # Everything is created with "add", which keeps the set elements that
+        # survived a restart. The chain is flushed so its rules are not duplicated.
+        script = [
+            f"add table {table}",
+            f"add set {table} protected {{ type inet_proto . inet_service; }}",
+            f"flush set {table} protected",
+            f"add element {table} protected {{ {protected} }}",
+            f"add set {table} allowed4 {{ type ipv4_addr . inet_proto . inet_service; flags interval; }}",
+            f"add set {table} allowed6 {{ type ipv6_addr . inet_proto . inet_service; flags interval; }}",
+            f"add chain {table} input {{ type filter hook input priority -1; policy accept; }}",
+            f"flush chain {table} input",
+            # Live sessions are kept when a grant is revoked
+            f"add rule {table} input ct state established,related accept",
+            f"add rule {table} input ip saddr . meta l4proto . th dport @allowed4 accept",
+            f"add rule {table} input ip6 saddr . meta l4proto . th dport @allowed6 accept",
+            f"add rule {table} input meta l4proto . th dport @protected drop",
+            '',
+        ]
+        self.run(['nft', '-f', '-'], '\n'.join(script))
+
+    def apply(self, add, remove):
+        if not add and not remove:
+            return
+        table = f"inet {config.NFT_TABLE}"
+        script = []
+        add4, add6 = split_families(add)
+        remove4, remove6 = split_families(remove)
+        for set_name, add_rules, remove_rules in [('allowed4', add4, remove4), ('allowed6', add6, remove6)]:
+            if add_rules:
+                script.append(f"add element {table} {set_name} {{ {self.elements(add_rules)} }}")
+            if remove_rules:
+                script.append(f"delete element {table} {set_name} {{ {self.elements(remove_rules)} }}")
+        script.append('')
+        self.run(['nft', '-f', '-'], '\n'.join(script))
+
+    def list_rules(self):
+        return self.list_set_rules('allowed4') + self.list_set_rules('allowed6')
+
+    def list_set_rules(self, set_name):
+        # Elements of the set, from its JSON listing. Each one is a concatenation
+        # of the source (an address or a prefix), the protocol and the port.
+        output = self.run(['nft', '-j', 'list', 'set', 'inet', config.NFT_TABLE, set_name])
+        if not output:
+            return []
+        rules = []
+        for item in json.loads(output)['nftables']:
+            for element in item.get('set', {}).get('elem', []):
+                source, proto, port = element['concat']
+                if isinstance(source, dict):
+                    source = f"{source['prefix']['addr']}/{source['prefix']['len']}"
+                rules.append(Rule(normalize_source(source), int(port), proto))
+        return rules
+
+    def elements(self, rules):
+        return ', '.join(f"{rule.ip} . {rule.proto} . {rule.port}" for rule in rules)
+
+class XdpBackend(FirewallBackend):
+    """
+    Keeps the grants in BPF maps checked by an XDP program (bpf/openme_xdp.c)
+    attached to the XDP_INTERFACES. It drops the packets to OPEN_PORTS unless
+    their source is granted, before the network stack sees them. The maps are
+    pinned in BPF_PIN_DIR, so the grants survive a restart, and updated with
+    bpf() system calls (see bpfmap.py): nothing is spawned per commit. The
+    program is loaded and attached with bpftool at setup. Unlike the other
+    backends, the elements of a commit are not applied atomically.
+    """
+    name = 'xdp'
+    # name -> (type, key size, flags, largest number of elements) of the maps
+    MAPS = {
+        'allowed4': (bpfmap.BPF_MAP_TYPE_LPM_TRIE, 12, bpfmap.BPF_F_NO_PREALLOC, bpfmap.MAX_ENTRIES),
+        'allowed6': (bpfmap.BPF_MAP_TYPE_LPM_TRIE, 24, bpfmap.BPF_F_NO_PREALLOC, bpfmap.MAX_ENTRIES),
+        'protected': (bpfmap.BPF_MAP_TYPE_HASH, 4, 0, 65536 * 2),
+    }
+    PROTOCOLS = {'tcp': 6, 'udp': 17}
+
+    def __init__(self):
+        self.maps = {}
+
+    def setup(self):
+        program = os.path.join(config.BPF_PIN_DIR, 'program')
+        if not config.DEBUG:
+            os.makedirs(config.BPF_PIN_DIR, exist_ok=True)
+            for name, (map_type, key_size, flags, max_entries) in self.MAPS.items():
+                if name not in self.maps:
+                    self.maps[name] = self.open_map(name, map_type, key_size, flags, max_entries)
+            # Protect the OPEN_PORTS of the configuration, and only them
+            protected = {self.port_key(proto, port) for port in config.OPEN_PORTS for proto in self.PROTOCOLS}
+            for key in protected:
+                self.maps['protected'].update(key, b'\1')
+            for key in set(self.maps['protected'].keys()) - protected:
+                self.maps['protected'].delete(key)
+            # A program loaded by the previous run stays attached until replaced
+            if os.path.exists(program):
+                os.unlink(program)
+
+        load = ['bpftool', 'prog', 'load', config.BPF_OBJECT, program, 'type', 'xdp']
+        for name in self.MAPS:
+            load += ['map', 'name', name, 'pinned', os.path.join(config.BPF_PIN_DIR, name)]
+        self.run(load)
+        for interface in config.XDP_INTERFACES:
+            self.run(['bpftool', 'net', 'attach', config.XDP_MODE, 'pinned', program, 'dev', interface, 'overwrite'])
+
+    def open_map(self, name, map_type, key_size, flags, max_entries):
+        # The map pinned by a previous run, with its grants, or a new one
+        path = os.path.join(config.BPF_PIN_DIR, name)
+        if os.path.exists(path):
+            return bpfmap.BpfMap.pinned(path, key_size, 1)
+        bpf_map = bpfmap.BpfMap.create(name, map_type, key_size, 1, max_entries, flags)
+        bpf_map.pin(path)
+        return bpf_map
+
+    def apply(self, add, remove):
+        if config.DEBUG:
+            for action, rules in [('add', add), ('delete', remove)]:
+                if rules:
+                    logger.info(f"bpf {action} {self.elements(rules)}")
+            return
+        for rule in add:
+            self.maps[self.map_name(rule)].update(self.rule_key(rule), b'\1')
+        for rule in remove:
+            self.maps[self.map_name(rule)].delete(self.rule_key(rule))
+
+    def list_rules(self):
+        if config.DEBUG:
+            return []
+        return [self.key_rule(key) for name in ('allowed4', 'allowed6') for key in self.maps[name].keys()]
+
+    def map_name(self, rule):
+        return 'allowed6' if is_ipv6(rule) else 'allowed4'
+
+    def port_key(self, proto, port):
+        # struct protected_key
+        return struct.pack('=Bx', self.PROTOCOLS[proto]) + struct.pack('>H', port)
+
+    def rule_key(self, rule):
+        # struct allowed4_key or allowed6_key. The prefix length covers the
+        # protocol and the port, which always match exactly, then the source.
+        network = ipaddress.ip_network(rule.ip, strict=False)
+        return struct.pack('=I', 32 + network.prefixlen) + self.port_key(rule.proto, rule.port) + network.network_address.packed
+
+    def key_rule(self, key):
+        prefixlen, proto, port = struct.unpack('=IBx', key[:6]) + struct.unpack('>H', key[6:8])
+        address = ipaddress.ip_address(key[8:])
+        names = {number: name for name, number in self.PROTOCOLS.items()}
+        return Rule(normalize_source(f"{address}/{prefixlen - 32}"), port, names[proto])
+
+    def elements(self, rules):
+        return ', '.join(f"{rule.ip} . {rule.proto} . {rule.port}" for rule in rules)
+
+class StubBackend(FirewallBackend):
+    """
+    Does not touch the firewall, nor logs anything. Used to benchmark the rest
+    of the knock path (see python-client/openme_bench.py).
+    """
+    name = 'stub'
+
+    def apply(self, add, remove):
+        pass
+
+BACKENDS = {backend.name: backend for backend in [IptablesBackend, IptablesRestoreBackend, IpsetBackend, NftSetBackend, XdpBackend, StubBackend]}
+
+def create_backend(name):
+    # Instantiate the backend configured in config.FIREWALL_BACKEND
+    if name not in BACKENDS:
+        raise ValueError(f"Unknown firewall backend: {name}. Available: {', '.join(BACKENDS)}")
+    return BACKENDS[name]()
+
+class FirewallCommitter:
+    """
+    Serializes all the firewall updates through a single thread. Updates
+    submitted within config.FIREWALL_BATCH_WINDOW seconds of each other are
+    applied by the backend in one commit.
+    """
+
+    def __init__(self, backend):
+        self.backend = backend
+        self.pending = queue.Queue()
+        # Returns the rules granted, for the garbage collection. None disables it.
+        self.active_rules = None
+        # Rules found not granted by the last garbage collection
+        self.suspects = set()
+        self.thread = threading.Thread(target=self.run, name='openmed-firewall', daemon=True)
+
+    def start(self):
+        self.backend.setup()
+        self.thread.start()
+
+    def submit(self, add=(), remove=()):
+        # Queue an update. The returned future is resolved once it is committed.
+        future = Future()
+        self.pending.put((list(add), list(remove), future))
+        return future
+
+    def run(self):
+        next_collection = time.monotonic() + (config.FIREWALL_GC_INTERVAL or 0)
+        while True:
+            # The garbage collection runs in between the commits, so it never
+            # races one, even when updates keep coming
+            if config.FIREWALL_GC_INTERVAL and time.monotonic() >= next_collection:
+                self.collect_garbage()
+                next_collection = time.monotonic() + config.FIREWALL_GC_INTERVAL
+            # Wait for the first update, then gather the ones that follow it
+            timeout = max(next_collection - time.monotonic(), 0) if config.FIREWALL_GC_INTERVAL else None
+            try:
+                batch = [self.pending.get(timeout=timeout)]
+            except queue.Empty:
+                continue
+            deadline = time.monotonic() + config.FIREWALL_BATCH_WINDOW
+            while len(batch) < config.FIREWALL_BATCH_MAX_UPDATES:
+                timeout = deadline - time.monotonic()
+                if timeout <= 0:
+                    break
+                try:
+                    batch.append(self.pending.get(timeout=timeout))
+                except queue.Empty:
+                    break
+            self.commit(batch)
+
+    def collect_garbage(self):
+        if self.active_rules is None:
+            return
+        try:
+            self.suspects = self.backend.collect_garbage(self.active_rules(), self.suspects)
+        except Exception as e:
+            logger.error(f"Firewall garbage collection failed: {e}")
+
+    def commit(self, batch):
+        # Net out the updates in order: a rule revoked and granted again within
+        # the batch (or the other way round) needs no change at all
+        add = {}
+        remove = {}
+        for update in batch:
+            for rule in update[1]:
+                if add.pop(rule, None) is None:
+                    remove[rule] = True
+            for rule in update[0]:
+                if remove.pop(rule, None) is None:
+                    add[rule] = True
+        add = list(add)
+        remove = list(remove)
+        try:
+            with metrics.firewall_apply_duration.time(backend=self.backend.name):
+                self.backend.apply(add, remove)
+        except Exception as e:
+            metrics.firewall_commits_total.inc(backend=self.backend.name, result='failed')
+            if len(batch) == 1:
+                batch[0][2].set_exception(e)
+                return
+            # The transaction is atomic, so one bad update fails the whole batch.
+            # Retry them one by one so the others still go through.
+            logger.error(f"Firewall commit of {len(batch)} updates failed ({e}), retrying them one by one")
+            for update in batch:
+                self.commit([update])
+            return
+        metrics.firewall_commits_total.inc(backend=self.backend.name, result='ok')
+        metrics.firewall_rules_total.inc(len(add), action='add')
+        metrics.firewall_rules_total.inc(len(remove), action='remove')
+        for update in batch:
+            update[2].set_result(True)
@@ -0,0 +1,272 @@
+"""
+Table of the active grants and the scheduler that revokes them once they expire.
+
+Every rule granted is indexed with its expiry time. Expiries are also kept in a
+heap, so the scheduler only looks at the grants that are due instead of
+scanning the whole table. Knocking again refreshes the expiry of a grant: the
+new expiry is pushed to the heap and the stale heap entry is skipped when it
+comes up. Grants also record their owner, the name of the client certificate
+(or SPA key) that asked for them, so they can be listed and revoked by client
+(see admin.py). With a journal (see journal.py), every change is also recorded
+there, so the table can be recovered after a restart, and with a replicator
+(see replication.py) the local grants and revocations are sent to the peer
+gateways.
+
+The firewall and journal updates are queued with the table lock held, so they
+are applied in the order of the table changes: a rule that expires or is
+revoked while it is granted again cannot have its removal applied after the
+addition of the new grant.
+"""
+
+import collections
+import heapq
+import logging
+import math
+import threading
+import time
+
+import config
+
+logger = logging.getLogger('openme_logger')
+
+class GrantTable:
+
+    def __init__(self, committer, journal=None):
+        self.committer = committer
+        self.journal = journal
+        self.replicator = None
+        # rule -> expiry (time.time() based, math.inf for grants that never expire)
+        self.expiries = {}
+        # rule -> owner, for the grants whose owner is known
+        self.owners = {}
+        # (expiry, rule) entries, some of them stale
+        self.heap = []
+        self.lock = threading.Lock()
+        self.wakeup = threading.Condition(self.lock)
+        self.thread = threading.Thread(target=self.run, name='openmed-expiry', daemon=True)
+
+    def start(self):
+        self.thread.start()
+
+    def grant(self, rules, ttl=None, wait=True, owner=None):
+        """
+        Grants the rules for ttl seconds (config.GRANT_TTL by default) and, if
+        wait is set, waits until the new ones are in the firewall. Rules already
+        granted only get their expiry refreshed, and owner becomes their owner.
+        Returns the expiry time.
+        """
+        if ttl is None:
+            ttl = config.GRANT_TTL
+        expiry = time.time() + ttl if ttl else math.inf
+        with self.lock:
+            new_rules = [rule for rule in rules if rule not in self.expiries]
+            for rule in rules:
+                self.expiries[rule] = expiry
+                if owner is not None:
+                    self.owners[rule] = owner
+                if expiry != math.inf:
+                    heapq.heappush(self.heap, (expiry, rule))
+            self.compact()
+            # Wake up the scheduler in case this is now the next grant to expire
+            self.wakeup.notify()
+            if self.journal is not None:
+                self.journal.put(rules, expiry, owner)
+            addition = self.committer.submit(add=new_rules) if new_rules else None
+        if self.replicator is not None:
+            self.replicator.publish(rules, expiry, owner)
+
+        if addition is not None:
+            self.watch(addition, {rule: expiry for rule in new_rules}, wait)
+        return expiry
+
+    def watch(self, addition, expiries, wait):
+        # Forget the new rules if adding them to the firewall fails. Not called
+        # with the lock held: the future may already be done.
+        addition.add_done_callback(lambda future: self.forget_failed(future, expiries))
+        if wait:
+            addition.result()
+
+    def merge(self, expiries, owners):
+        """
+        Grants the rules until the given expiries, unless they are already
+        granted for longer. Used for the grants replicated from the peers,
+        which are not published again. Returns the number of rules updated.
+        """
+        now = time.time()
+        new_rules = []
+        updated = {}
+        with self.lock:
+            for rule, expiry in expiries.items():
+                current = self.expiries.get(rule)
+                if expiry <= now or (current is not None and current >= expiry):
+                    continue
+                if current is None:
+                    new_rules.append(rule)
+                self.expiries[rule] = updated[rule] = expiry
+                if owners.get(rule) is not None:
+                    self.owners[rule] = owners[rule]
+                if expiry != math.inf:
+                    heapq.heappush(self.heap, (expiry, rule))
+            self.compact()
+            self.wakeup.notify()
+            if self.journal is not None:
+                # One journal update per expiry and owner, usually one per knock
+                batches = collections.defaultdict(list)
+                for rule, expiry in updated.items():
+                    batches[expiry, owners.get(rule)].append(rule)
+                for (expiry, owner), rules in batches.items():
+                    self.journal.put(rules, expiry, owner)
+            addition = self.committer.submit(add=new_rules) if new_rules else None
+        if addition is not None:
+            self.watch(addition, {rule: updated[rule] for rule in new_rules}, wait=False)
+        return len(updated)
+
+    def revoke(self, expiries, publish=True):
+        """
+        Revokes grants before they expire. expiries maps each rule to the
+        expiry of the grant to revoke: a rule granted again since, until later,
+        is kept. Waits until the rules are out of the firewall, and returns them.
+        Unless publish is unset, the revocation is sent to the peers as well.
+        """
+        with self.lock:
+            revoked = [rule for rule, expiry in expiries.items() if rule in self.expiries and self.expiries[rule] <= expiry]
+            removal = self.remove(revoked)
+        if publish and self.replicator is not None:
+            self.replicator.publish_revoke(expiries)
+        if removal is not None:
+            removal.result()
+        return revoked
+
+    def snapshot(self):
+        # (rule, expiry, owner) of all the active grants
+        with self.lock:
+            return [(rule, expiry, self.owners.get(rule)) for rule, expiry in self.expiries.items()]
+
+    def active_rules(self):
+        # The rules of all the active grants
+        with self.lock:
+            return set(self.expiries)
+
+    def forget(self, rules):
+        # Drop the rules from the table and the journal. Called with the lock held
+        for rule in rules:
+            del self.expiries[rule]
+            self.owners.pop(rule, None)
+        if self.journal is not None and rules:
+            self.journal.delete(rules)
+
+    def remove(self, rules):
+        # Forget the rules and queue their removal from the firewall. Called
+        # with the lock held. Returns the future of the removal, None if there
+        # are no rules
+        if not rules:
+            return None
+        self.forget(rules)
+        return self.committer.submit(remove=rules)
+
+    def forget_failed(self, future, expiries):
+        # Forget the rules that could not be added, unless granted again meanwhile
+        if future.exception() is None:
+            return
+        with self.lock:
+            failed = [rule for rule, expiry in expiries.items() if self.expiries.get(rule) == expiry]
+            self.forget(failed)
+
+    def restore(self, rules, ttl=None):
+        """
+        Indexes rules that are already in the firewall, e.g. found in the live
+        ruleset at startup, so knocking again does not add them a second time
+        and they expire like the others.
+        """
+        if ttl is None:
+            ttl = config.GRANT_TTL
+        expiry = time.time() + ttl if ttl else math.inf
+        loaded = self.load({rule: expiry for rule in rules}, replace=False)
+        if self.journal is not None:
+            self.journal.put(loaded, expiry)
+
+    def load(self, expiries, replace=True, owners={}):
+        # Index the rules with the given expiries and owners. Without replace,
+        # the rules already in the table keep theirs. Returns the rules indexed.
+        with self.lock:
+            loaded = [rule for rule in expiries if replace or rule not in self.expiries]
+            for rule in loaded:
+                expiry = self.expiries[rule] = expiries[rule]
+                if owners.get(rule) is not None:
+                    self.owners[rule] = owners[rule]
+                if expiry != math.inf:
+                    heapq.heappush(self.heap, (expiry, rule))
+            self.wakeup.notify()
+        return loaded
+
+    def recover(self, live_rules):
+        """
+        Rebuilds the table at startup from the journal and the rules found in
+        the live firewall, reconciled in one firewall commit: journaled grants
+        missing from the firewall are added again, the ones that expired while
+        the daemon was down are removed, and the rules only in the firewall are
+        restored like restore() does. Returns the numbers of rules restored,
+        added and removed.
+        """
+        if self.journal is None:
+            self.restore(live_rules)
+            return len(live_rules), 0, 0
+        journaled, owners = self.journal.load()
+        live_rules = set(live_rules)
+        now = time.time()
+        expired = [rule for rule, expiry in journaled.items() if expiry <= now]
+        active = {rule: expiry for rule, expiry in journaled.items() if expiry > now}
+        add = [rule for rule in active if rule not in live_rules]
+        remove = [rule for rule in expired if rule in live_rules]
+        if add or remove:
+            try:
+                self.committer.submit(add=add, remove=remove).result()
+            except Exception as e:
+                logger.error(f"Error reconciling the firewall with the grant journal: {e}")
+                # The clients will have to knock again
+                for rule in add:
+                    del active[rule]
+                expired += add
+        self.journal.delete(expired)
+
+        # Journaled expiries first, so restore() only picks up the rules unknown to the journal
+        self.load(active, owners=owners)
+        unknown = [rule for rule in live_rules if rule not in journaled]
+        self.restore(unknown)
+        return len(active) + len(unknown), len(add), len(remove)
+
+    def compact(self):
+        # Rebuild the heap when refreshes have left it mostly with stale entries
+        if len(self.heap) > 2 * len(self.expiries) + 1024:
+            self.heap = [(expiry, rule) for rule, expiry in self.expiries.items() if expiry != math.inf]
+            heapq.heapify(self.heap)
+
+    def run(self):
+        while True:
+            with self.lock:
+                # Sleep until the earliest expiry, plus the resolution so that the
+                # grants expiring close to each other are revoked together
+                while True:
+                    if not self.heap:
+                        self.wakeup.wait()
+                        continue
+                    delay = self.heap[0][0] + config.GRANT_EXPIRY_RESOLUTION - time.time()
+                    if delay <= 0:
+                        break
+                    self.wakeup.wait(delay)
+
+                now = time.time()
+                expired = []
+                while self.heap and self.heap[0][0] <= now:
+                    expiry, rule = heapq.heappop(self.heap)
+                    # Skip the entries left behind by a refresh
+                    if self.expiries.get(rule) == expiry:
+                        expired.append(rule)
+                removal = self.remove(expired)
+
+            if removal is not None:
+                logger.info(f"openmed: Revoking {len(expired)} expired rules")
+                try:
+                    removal.result()
+                except Exception as e:
+                    logger.error(f"Error revoking expired rules: {e}")
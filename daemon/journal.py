@@ -0,0 +1,108 @@
+"""
+Journal of the grants, kept in SQLite so they survive a restart of openmed.
+
+Each granted rule is a row with its expiry and owner, written when it is granted or
+refreshed and deleted when it is revoked. The database is in WAL mode: writes
+are appended to the write-ahead log, which is checkpointed back into the
+database every config.GRANT_JOURNAL_COMPACT_INTERVAL seconds. Writes are done
+by a background thread, in one transaction per batch, so the request path
+never waits for the disk. A crash loses at most the last batch, and the rules
+of that batch are still found in the live firewall at startup.
+"""
+
+import logging
+import math
+import queue
+import sqlite3
+import threading
+import time
+
+import config
+from firewall import Rule
+
+logger = logging.getLogger('openme_logger')
+
+# Largest number of updates written in one transaction
+BATCH_SIZE = 1000
+
+class GrantJournal:
+
+    def __init__(self, path):
+        self.db = sqlite3.connect(path, check_same_thread=False, isolation_level=None)
+        self.db.execute('PRAGMA journal_mode=WAL')
+        # In WAL mode, NORMAL only syncs on checkpoints
+        self.db.execute('PRAGMA synchronous=NORMAL')
+        self.db.execute('CREATE TABLE IF NOT EXISTS grants (ip TEXT, port INTEGER, proto TEXT, expiry REAL, '
+                        'owner TEXT, PRIMARY KEY (ip, port, proto)) WITHOUT ROWID')
+        # Journals written before grants had owners
+        columns = [row[1] for row in self.db.execute('PRAGMA table_info(grants)')]
+        if 'owner' not in columns:
+            self.db.execute('ALTER TABLE grants ADD COLUMN owner TEXT')
+        self.pending = queue.Queue()
+        self.thread = threading.Thread(target=self.run, name='openmed-journal', daemon=True)
+
+    def start(self):
+        self.thread.start()
+
+    def load(self):
+        # rule -> expiry and rule -> owner of all the journaled grants. Called before start().
+        expiries = {}
+        owners = {}
+        for ip, port, proto, expiry, owner in self.db.execute('SELECT ip, port, proto, expiry, owner FROM grants'):
+            rule = Rule(ip, port, proto)
+            expiries[rule] = math.inf if expiry is None else expiry
+            if owner is not None:
+                owners[rule] = owner
+        return expiries, owners
+
+    def put(self, rules, expiry, owner=None):
+        # Record the rules as granted until expiry. Rules granted again
+        # without an owner keep the one they had.
+        self.pending.put(('put', list(rules), (None if expiry == math.inf else expiry, owner)))
+
+    def delete(self, rules):
+        # Record the rules as revoked
+        self.pending.put(('delete', list(rules), None))
+
+    def run(self):
+        next_compaction = time.monotonic() + config.GRANT_JOURNAL_COMPACT_INTERVAL
+        while True:
+            try:
+                batch = [self.pending.get(timeout=max(next_compaction - time.monotonic(), 0))]
+            except queue.Empty:
+                batch = []
+            while batch and len(batch) < BATCH_SIZE:
+                try:
+                    batch.append(self.pending.get_nowait())
+                except queue.Empty:
+                    break
+            try:
+                if batch:
+                    self.write(batch)
+                if time.monotonic() >= next_compaction:
+                    self.compact()
+                    next_compaction = time.monotonic() + config.GRANT_JOURNAL_COMPACT_INTERVAL
+            except sqlite3.Error as e:
+                logger.error(f"Error writing the grant journal: {e}")
+
+    def write(self, batch):
+        # Apply the updates in order, in one transaction
+        with self.db:
+            self.db.execute('BEGIN')
+            for action, rules, values in batch:
+                if action == 'put':
+                    expiry, owner = values
+                    self.db.executemany('INSERT INTO grants VALUES (?, ?, ?, ?, ?) ON CONFLICT (ip, port, proto) DO UPDATE SET '
+                                        'expiry = excluded.expiry, owner = coalesce(excluded.owner, owner)',
+                                        [(rule.ip, rule.port, rule.proto, expiry, owner) for rule in rules])
+                else:
+                    self.db.executemany('DELETE FROM grants WHERE ip = ? AND port = ? AND proto = ?',
+                                        [(rule.ip, rule.port, rule.proto) for rule in rules])
+
+    def compact(self):
+        # Drop the grants that should have been revoked long ago, e.g. by a
+        # daemon that crashed, and fold the write-ahead log into the database
+        with self.db:
+            self.db.execute('BEGIN')
+            self.db.execute('DELETE FROM grants WHERE expiry < ?', (time.time() - config.GRANT_JOURNAL_COMPACT_INTERVAL,))
+        self.db.execute('PRAGMA wal_checkpoint(TRUNCATE)')
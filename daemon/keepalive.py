@@ -0,0 +1,85 @@
+"""
+Idle persistent connections.
+
+Clients that ask for it (see protocol.py) keep their TLS connection open between
+requests. While they are idle, their connections are not held by a worker:
+they are all watched by a single thread with a selector, and handed back to
+the workers when the next request arrives. Connections idle for longer than
+config.KEEPALIVE_IDLE_TIMEOUT are closed.
+"""
+
+import collections
+import logging
+import os
+import selectors
+import threading
+import time
+
+import config
+
+logger = logging.getLogger('openme_logger')
+
+class IdleConnections:
+
+    def __init__(self, dispatch):
+        # dispatch(conn, addr) is called, from the poller thread, when a
+        # connection has data to read (or was closed by the client)
+        self.dispatch = dispatch
+        self.selector = selectors.DefaultSelector()
+        # conn -> (addr, time it became idle), in the order they became idle
+        self.idle = collections.OrderedDict()
+        # Connections added by the workers, registered by the poller thread
+        self.added = collections.deque()
+        self.wakeup_read, self.wakeup_write = os.pipe()
+        os.set_blocking(self.wakeup_write, False)
+        self.selector.register(self.wakeup_read, selectors.EVENT_READ)
+        self.thread = threading.Thread(target=self.run, name='openmed-keepalive', daemon=True)
+
+    def start(self):
+        self.thread.start()
+
+    def __len__(self):
+        return len(self.idle)
+
+    def add(self, conn, addr):
+        # Called by a worker once it is done with the request of conn
+        if conn.pending():
+            # The next request is already buffered by TLS, the selector would not see it
+            self.dispatch(conn, addr)
+            return
+        self.added.append((conn, addr))
+        try:
+            os.write(self.wakeup_write, b'\0')
+        except BlockingIOError:
+            # The poller has already been woken up
+            pass
+
+    def run(self):
+        while True:
+            for key, _ in self.selector.select(timeout=1):
+                if key.fileobj == self.wakeup_read:
+                    os.read(self.wakeup_read, 4096)
+                    continue
+                conn = key.fileobj
+                self.selector.unregister(conn)
+                addr, _ = self.idle.pop(conn)
+                self.dispatch(conn, addr)
+
+            while self.added:
+                conn, addr = self.added.popleft()
+                if len(self.idle) >= config.KEEPALIVE_MAX_CONNECTIONS:
+                    logger.error(f"Too many idle connections, closing the one from {addr[0]}")
+                    conn.close()
+                    continue
+                self.selector.register(conn, selectors.EVENT_READ)
+                self.idle[conn] = (addr, time.monotonic())
+
+            # The least recently active connections come first
+            deadline = time.monotonic() - config.KEEPALIVE_IDLE_TIMEOUT
+            while self.idle:
+                conn, (addr, since) = next(iter(self.idle.items()))
+                if since > deadline:
+                    break
+                del self.idle[conn]
+                self.selector.unregister(conn)
+                conn.close()
@@ -0,0 +1,135 @@
+"""
+Non-blocking logging for openmed.
+
+Log records are put in a bounded in-memory queue and written by a background
+thread, which drains them in batches to syslog, journald, a file or stderr. The
+request path never waits for log I/O: when the queue is full the record is
+dropped and counted in openmed_log_records_dropped_total.
+"""
+
+import logging
+import logging.handlers
+import queue
+import socket
+import struct
+import threading
+
+import config
+import metrics
+
+records_dropped = metrics.Counter('openmed_log_records_dropped_total', 'Log records dropped because the log queue was full')
+queue_depth = metrics.Gauge('openmed_log_queue_depth', 'Log records waiting to be written')
+
+class DroppingQueueHandler(logging.handlers.QueueHandler):
+    """
+    Queues the records without ever blocking. Records that do not fit are dropped.
+    """
+
+    def enqueue(self, record):
+        try:
+            self.queue.put_nowait(record)
+        except queue.Full:
+            records_dropped.inc()
+
+class JournaldHandler(logging.Handler):
+    """
+    Sends the records to the systemd journal through its native socket, with
+    the priority and the logger name as fields.
+    """
+
+    PRIORITIES = {logging.CRITICAL: 2, logging.ERROR: 3, logging.WARNING: 4, logging.INFO: 6, logging.DEBUG: 7}
+
+    def __init__(self, address='/run/systemd/journal/socket', identifier='openmed'):
+        super().__init__()
+        self.address = address
+        self.identifier = identifier
+        self.socket = socket.socket(socket.AF_UNIX, socket.SOCK_DGRAM)
+
+    def emit(self, record):
+        try:
+            fields = {
+                'MESSAGE': self.format(record),
+                'PRIORITY': str(self.PRIORITIES.get(record.levelno, 6)),
+                'SYSLOG_IDENTIFIER': self.identifier,
+                'LOGGER': record.name,
+            }
+            datagram = b''
+            for name, value in fields.items():
+                value = value.encode()
+                if b'\n' in value:
+                    # Multi-line values are sent with an explicit length
+                    datagram += name.encode() + b'\n' + struct.pack('<Q', len(value)) + value + b'\n'
+                else:
+                    datagram += name.encode() + b'=' + value + b'\n'
+            self.socket.sendto(datagram, self.address)
+        except Exception:
+            self.handleError(record)
+
+    def close(self):
+        self.socket.close()
+        super().close()
+
+class BatchingListener:
+    """
+    Background thread that takes the records out of the queue, up to
+    config.LOG_BATCH_SIZE at a time, and writes them to the handler.
+    """
+
+    def __init__(self, records, handler):
+        self.records = records
+        self.handler = handler
+        self.thread = threading.Thread(target=self.run, name='openmed-log', daemon=True)
+
+    def start(self):
+        self.thread.start()
+
+    def run(self):
+        while True:
+            batch = [self.records.get()]
+            while len(batch) < config.LOG_BATCH_SIZE:
+                try:
+                    batch.append(self.records.get_nowait())
+                except queue.Empty:
+                    break
+            for record in batch:
+                if record.levelno >= self.handler.level:
+                    self.handler.handle(record)
+            self.handler.flush()
+
+def create_handler(backend):
+    # Handler that writes the records to the configured LOG_BACKEND
+    if backend == 'syslog':
+        handler = logging.handlers.SysLogHandler(address=config.SYSLOG_ADDRESS)
+    elif backend == 'journald':
+        handler = JournaldHandler()
+    elif backend == 'file':
+        handler = logging.FileHandler(config.LOG_FILE)
+    elif backend == 'stderr':
+        handler = logging.StreamHandler()
+    else:
+        raise ValueError(f"Unknown log backend: {backend}")
+
+    if backend in ('file', 'stderr'):
+        formatter = logging.Formatter('%(asctime)s %(name)s: %(levelname)s %(message)s')
+    else:
+        formatter = logging.Formatter('%(name)s: %(message)s')
+    handler.setFormatter(formatter)
+    handler.setLevel(logging.INFO)
+    return handler
+
+def setup_logging(logger, background=True):
+    # Route the logger through the queue to the configured backend. Replaces
+    # the handlers set up before, e.g. by the parent before forking. Without
+    # background, the records are written directly instead.
+    for handler in list(logger.handlers):
+        logger.removeHandler(handler)
+    if not background:
+        logger.addHandler(create_handler(config.LOG_BACKEND))
+        return None
+
+    records = queue.Queue(maxsize=config.LOG_QUEUE_SIZE)
+    logger.addHandler(DroppingQueueHandler(records))
+    listener = BatchingListener(records, create_handler(config.LOG_BACKEND))
+    listener.start()
+    queue_depth.function = records.qsize
+    return listener
@@ -0,0 +1,165 @@
+"""
+Counters, gauges and latency histograms of openmed, exported in the Prometheus
+text format by an optional HTTP listener (see config.METRICS_PORT).
+"""
+
+import http.server
+import logging
+import threading
+import time
+
+logger = logging.getLogger('openme_logger')
+
+# Latency buckets in seconds, from 100us to 10s
+LATENCY_BUCKETS = [0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10]
+
+registry = []
+
+def format_labels(labels):
+    if not labels:
+        return ''
+    return '{' + ','.join(f'{name}="{value}"' for name, value in labels) + '}'
+
+class Metric:
+
+    def __init__(self, name, help, type):
+        self.name = name
+        self.help = help
+        self.type = type
+        self.lock = threading.Lock()
+        registry.append(self)
+
+    def render(self):
+        lines = [f"# HELP {self.name} {self.help}", f"# TYPE {self.name} {self.type}"]
+        return lines + self.samples()
+
+class Counter(Metric):
+
+    def __init__(self, name, help):
+        super().__init__(name, help, 'counter')
+        self.values = {}
+
+    def inc(self, value=1, **labels):
+        key = tuple(sorted(labels.items()))
+        with self.lock:
+            self.values[key] = self.values.get(key, 0) + value
+
+    def value(self, **labels):
+        return self.values.get(tuple(sorted(labels.items())), 0)
+
+    def samples(self):
+        with self.lock:
+            return [f"{self.name}{format_labels(key)} {value}" for key, value in self.values.items()]
+
+class Gauge(Metric):
+    """
+    A gauge whose value is read from a function when the metrics are exported.
+    """
+
+    def __init__(self, name, help, function=None):
+        super().__init__(name, help, 'gauge')
+        self.function = function
+
+    def samples(self):
+        if self.function is None:
+            return []
+        return [f"{self.name} {self.function()}"]
+
+class Histogram(Metric):
+
+    def __init__(self, name, help, buckets=LATENCY_BUCKETS):
+        super().__init__(name, help, 'histogram')
+        self.buckets = buckets
+        # labels -> [count per bucket, sum, count]
+        self.values = {}
+
+    def observe(self, value, **labels):
+        key = tuple(sorted(labels.items()))
+        with self.lock:
+            entry = self.values.get(key)
+            if entry is None:
+                entry = self.values[key] = [[0] * len(self.buckets), 0.0, 0]
+            for i, bound in enumerate(self.buckets):
+                if value <= bound:
+                    entry[0][i] += 1
+                    break
+            entry[1] += value
+            entry[2] += 1
+
+    def time(self, **labels):
+        # Context manager that observes the time spent in its block
+        return Timer(self, labels)
+
+    def samples(self):
+        lines = []
+        with self.lock:
+            for key, (counts, total, count) in self.values.items():
+                cumulative = 0
+                for bound, bucket_count in zip(self.buckets, counts):
+                    cumulative += bucket_count
+                    lines.append(f"{self.name}_bucket{format_labels(key + (('le', bound),))} {cumulative}")
+                lines.append(f"{self.name}_bucket{format_labels(key + (('le', '+Inf'),))} {count}")
+                lines.append(f"{self.name}_sum{format_labels(key)} {total}")
+                lines.append(f"{self.name}_count{format_labels(key)} {count}")
+        return lines
+
+class Timer:
+
+    def __init__(self, histogram, labels):
+        self.histogram = histogram
+        self.labels = labels
+
+    def __enter__(self):
+        self.start = time.perf_counter()
+        return self
+
+    def __exit__(self, *exc):
+        self.histogram.observe(time.perf_counter() - self.start, **self.labels)
+
+def render():
+    # All the metrics in the Prometheus text exposition format
+    lines = []
+    for metric in registry:
+        lines += metric.render()
+    return '\n'.join(lines) + '\n'
+
+class MetricsHandler(http.server.BaseHTTPRequestHandler):
+
+    def do_GET(self):
+        if self.path != '/metrics':
+            self.send_error(404)
+            return
+        body = render().encode()
+        self.send_response(200)
+        self.send_header('Content-Type', 'text/plain; version=0.0.4')
+        self.send_header('Content-Length', str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+
+    def log_message(self, format, *args):
+        # Scrapes are not worth a log line each
+        pass
+
+def start_http_server(address, port):
+    # Serve /metrics from a background thread
+    server = http.server.ThreadingHTTPServer((address, port), MetricsHandler)
+    thread = threading.Thread(target=server.serve_forever, name='openmed-metrics', daemon=True)
+    thread.start()
+    logger.info(f"openmed: Serving metrics on http://{address}:{port}/metrics")
+    return server
+
+# Metrics of the knock path
+accept_wait = Histogram('openmed_accept_wait_seconds', 'Time accepted connections wait for a free worker')
+connections_total = Counter('openmed_connections_total', 'Connections accepted, or dropped because the worker queue was full')
+tls_handshake_duration = Histogram('openmed_tls_handshake_seconds', 'Duration of the TLS handshakes')
+tls_handshakes_total = Counter('openmed_tls_handshakes_total', 'TLS handshakes by result (full, resumed or failed)')
+parse_duration = Histogram('openmed_command_parse_seconds', 'Time spent parsing and validating the commands')
+commands_total = Counter('openmed_commands_total', 'Commands received by result')
+firewall_apply_duration = Histogram('openmed_firewall_apply_seconds', 'Duration of the firewall commits per backend')
+firewall_commits_total = Counter('openmed_firewall_commits_total', 'Firewall commits per backend and result')
+firewall_rules_total = Counter('openmed_firewall_rules_total', 'Rules added and removed from the firewall')
+grant_duration = Histogram('openmed_grant_seconds', 'Time from accepting the connection to the ports being open')
+queue_depth = Gauge('openmed_worker_queue_depth', 'Connections waiting for a free worker')
+firewall_queue_depth = Gauge('openmed_firewall_queue_depth', 'Updates waiting for the firewall thread')
+active_grants = Gauge('openmed_active_grants', 'Rules currently granted')
+idle_connections = Gauge('openmed_idle_connections', 'Persistent connections waiting for their next request')
@@ -0,0 +1,86 @@
+"""
+Lists and revokes the grants of a running openmed, and dumps the traces of
+its last knocks, over its administration socket (see admin.py). Run it on the
+gateway, as the user of the daemon:
+
+  python3 openmectl.py list --owner client1
+  python3 openmectl.py revoke --ip 10.0.0.0/24
+  python3 openmectl.py revoke --all
+  python3 openmectl.py trace --slower-than 100
+"""
+
+import argparse
+import json
+import socket
+import sys
+import time
+
+import config
+
+parser = argparse.ArgumentParser()
+parser.add_argument("-S", "--socket", default=config.ADMIN_SOCKET, help="Administration socket of the daemon")
+parser.add_argument("--json", action="store_true", help="Print the reply of the daemon as it is")
+commands = parser.add_subparsers(dest="command", required=True)
+for name, description in (("list", "List the active grants"), ("revoke", "Revoke the matching grants now")):
+    command = commands.add_parser(name, help=description)
+    command.add_argument("--ip", help="Only the grants to this address, or to addresses within this network")
+    command.add_argument("--port", type=int, help="Only the grants of this port")
+    command.add_argument("--proto", choices=["tcp", "udp"], help="Only the grants of this protocol")
+    command.add_argument("--owner", "--cn", help="Only the grants asked for by this client certificate (common name) or SPA key")
+    if name == "revoke":
+        command.add_argument("--all", action="store_true", help="Revoke all the grants")
+command = commands.add_parser("trace", help="Show the traces of the last knocks kept")
+command.add_argument("-n", "--limit", type=int, help="Only the last LIMIT traces")
+command.add_argument("--slower-than", type=float, default=0, metavar="MS", help="Only the knocks that took at least MS milliseconds")
+
+def request(path, message):
+    # Send one request to the daemon and return its reply
+    with socket.socket(socket.AF_UNIX, socket.SOCK_STREAM) as sock:
+        sock.connect(path)
+        sock.sendall(json.dumps(message).encode() + b'\n')
+        with sock.makefile('rb') as reply:
+            return json.loads(reply.readline())
+
+def print_trace(trace):
+    # One line per knock: when, from where, how long and the time of each stage
+    started = time.strftime("%Y-%m-%d %H:%M:%S", time.localtime(trace["start"]))
+    attributes = trace["attributes"]
+    stages = "  ".join(f"{span['name']} {span['duration'] * 1000:.2f}" for span in trace["spans"])
+    print(f"{started}  {attributes.get('client', '-'):<39} {attributes.get('result', '-'):<16} "
+          f"{trace['duration'] * 1000:>9.2f} ms  {stages}")
+
+def main():
+    args = parser.parse_args()
+    if args.command == "trace":
+        message = {"v": 1, "op": "trace", "min_duration": args.slower_than / 1000}
+        if args.limit is not None:
+            message["limit"] = args.limit
+    else:
+        criteria = {key: getattr(args, key) for key in ('ip', 'port', 'proto', 'owner') if getattr(args, key) is not None}
+        if args.command == "revoke" and args.all:
+            criteria['all'] = True
+        if args.command == "revoke" and not criteria:
+            parser.error("revoke needs a filter, or --all")
+        message = {"v": 1, "op": args.command, "filter": criteria}
+
+    try:
+        reply = request(args.socket, message)
+    except (OSError, ValueError) as e:
+        sys.exit(f"Cannot reach openmed on {args.socket}: {e}")
+    if args.json:
+        print(json.dumps(reply, indent=2))
+    elif reply.get("status") != "ok":
+        print(f"Error {reply.get('code')}: {reply.get('error')}", file=sys.stderr)
+    elif args.command == "list":
+        for grant in sorted(reply["grants"], key=lambda grant: (grant["ip"], grant["port"], grant["proto"])):
+            expires = "never" if grant["expires"] is None else time.strftime("%Y-%m-%d %H:%M:%S", time.localtime(grant["expires"]))
+            print(f"{grant['ip']:<40} {grant['port']:>5}/{grant['proto']:<3}  {expires:<19}  {grant['owner'] or '-'}")
+    elif args.command == "trace":
+        for trace in reply["traces"]:
+            print_trace(trace)
+    else:
+        print(f"{reply['revoked']} rules revoked")
+    sys.exit(0 if reply.get("status") == "ok" else 1)
+
+if __name__ == "__main__":
+    main()
@@ -2,75 +2,307 @@
 
 import socket
 import ssl
-import subprocess
 import daemon
+import importlib.util
+import signal
 import logging
-import logging.handlers
-import re
+import queue
+import threading
+import math
+import time
 
+import admin
 import config
+import firewall
+import grants
+import journal
+import metrics
+import logqueue
+import policy
+import keepalive
+import ratelimit
+import prefork
+import protocol
+import tlscontext
+import tracing
 
-def handle_client_connection(conn, addr):
+def handle_client_connection(conn, addr, accepted_at, trace):
     # Receive data from the client
     if config.DEBUG:
         print(f"Connection from {addr[0]}")
-    data = conn.recv(1024).decode().strip()
-
-    if data == "OPEN ME":
-        # Get the IP address of the connecting client
-        ip_address = addr[0]
-    elif data.startswith("OPEN "):
-        # Extract the IP address from the command
-        ip_address = data[5:].strip()
+    try:
+        with trace.span('recv'):
+            data = conn.recv(1024)
+    except (ssl.SSLError, OSError) as e:
+        # Covers clients that did not send anything within READ_TIMEOUT
+        logger.error(f"Error reading from {addr[0]}: {e}")
+        trace.set(result='read_failed')
+        conn.close()
+        return
+    if not data:
+        # The client closed the connection, e.g. a persistent one between two requests
+        trace.discard()
+        conn.close()
+        return
 
-        # Validate the IP address format (IPv4)
-        if not validate_ip_address(ip_address):
-            # Log an error message for invalid IP address format
-            logger.error(f"Invalid IP address format: {ip_address}")
-            # Close the connection
+    # JSON requests, see protocol.py. Persistent connections wait for their
+    # next request without holding a worker
+    if data.startswith(b'{'):
+        if handle_json_requests(conn, addr, data, accepted_at, trace):
+            idle_connections.add(conn, addr)
+        else:
             conn.close()
-            return
-    else:
-        # Log an error message for unknown command
-        logger.error(f"Unknown command from ip_address {addr[0]} data: {data}")
+        return
+    data = data.decode(errors='replace').strip()
+
+    parse_started = time.perf_counter()
+    try:
+        with trace.span('parse'):
+            ip_address = parse_command(data, addr)
+        with trace.span('authz'):
+            name = protocol.client_name(conn)
+            client_policy = client_policies.lookup(protocol.client_subject(conn))
+            allowed = ip_address is not None and authorize(client_policy, name, ip_address, addr)
+    finally:
+        # The rejected commands are timed too
+        metrics.parse_duration.observe(time.perf_counter() - parse_started)
+    if not allowed:
         # Close the connection
+        trace.set(result='rejected')
         conn.close()
         return
 
-    # Add a rule to iptables to allow incoming connections from the specified IP address
-    for port in config.OPEN_PORTS:
-        # we open both
-        open_tcp_port = ['iptables', '-A', 'INPUT', '-p', 'tcp', '-s', ip_address, '--dport', str(port), '-j', 'ACCEPT']
-        open_udp_port = ['iptables', '-A', 'INPUT', '-p', 'udp', '-s', ip_address, '--dport', str(port), '-j', 'ACCEPT']
-        if config.DEBUG:
-            open_tcp_port_s = ' '.join(open_tcp_port)
-            open_udp_port_s = ' '.join(open_udp_port)
-            logger.info(open_tcp_port_s)
-            logger.info(open_udp_port_s)
-        else:
-            subprocess.run(open_tcp_port)
-            subprocess.run(open_udp_port)
+    try:
+        with trace.span('commit'):
+            expiry = open_ports(ip_address, client_policy, owner=name)
+    except Exception as e:
+        logger.error(f"Error opening ports for {ip_address}: {e}")
+        metrics.commands_total.inc(result='failed')
+        trace.set(result='failed')
+        conn.close()
+        return
+    metrics.commands_total.inc(result='granted')
+    trace.set(result='granted', owner=name)
+    metrics.grant_duration.observe(time.perf_counter() - accepted_at)
 
     # Log a confirmation message
-    logger.info(f"openmed: Port opened for {ip_address}")
+    if expiry == math.inf:
+        logger.info(f"openmed: Port opened for {ip_address}")
+    else:
+        logger.info(f"openmed: Port opened for {ip_address} until {time.ctime(expiry)}")
 
     # Close the connection
     conn.close()
 
-def validate_ip_address(ip_address):
-    # Validate the IP address format using regular expression
-    ip_regex = r'^\d{1,3}\.\d{1,3}\.\d{1,3}\.\d{1,3}$'
-    return bool(re.match(ip_regex, ip_address))
+def handle_json_requests(conn, addr, data, accepted_at, trace):
+    # Serve the requests of the connection in order, pipelined ones included,
+    # each one with its own trace. Returns True if the connection is kept open
+    # for the next request
+    reader = protocol.LineReader(conn, data)
+    try:
+        while True:
+            try:
+                with trace.span('recv'):
+                    line = reader.read_line()
+            except protocol.ProtocolError as e:
+                logger.error(f"Invalid request from {addr[0]}: {e}")
+                metrics.commands_total.inc(result='invalid')
+                trace.set(result='invalid')
+                send_reply(conn, addr, protocol.error_reply(str(e), e.code))
+                return False
+            except (ssl.SSLError, OSError) as e:
+                logger.error(f"Error reading from {addr[0]}: {e}")
+                trace.set(result='read_failed')
+                return False
+            if line is None:
+                trace.discard()
+                return False
+            if not line.strip():
+                continue
 
-def main():
-    print("main")
- 
-    # Create a socket object
-    server_socket = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+            persistent = handle_json_request(conn, addr, line, accepted_at, trace)
+            if not persistent or not reader.buffered():
+                return persistent
+            # The next request was pipelined behind this one
+            trace.finish()
+            accepted_at = time.perf_counter()
+            trace = tracing.start(accepted_at, addr[0])
+    finally:
+        trace.finish()
+
+def handle_json_request(conn, addr, line, accepted_at, trace):
+    # Validate the whole request, grant all its rules in one commit and reply.
+    # Returns True if the client asked to keep the connection open
+    parse_started = time.perf_counter()
+    request_id = None
+    try:
+        with trace.span('parse'):
+            request = protocol.parse_request(line)
+            request_id = protocol.parse_request_id(request)
+            if request.get('op') != 'open':
+                raise protocol.ProtocolError(f"unknown operation {request.get('op')}")
+        with trace.span('authz'):
+            client_policy = client_policies.lookup(protocol.client_subject(conn))
+            if client_policy is None:
+                raise protocol.ProtocolError("no policy allows this client", protocol.FORBIDDEN)
+            rules = protocol.parse_open_request(request, addr[0], client_policy)
+            persistent = protocol.wants_keepalive(request) and idle_connections is not None
+    except protocol.ProtocolError as e:
+        # The rejected requests are timed too, before their reply
+        metrics.parse_duration.observe(time.perf_counter() - parse_started)
+        logger.error(f"Invalid request from {addr[0]}: {e}")
+        result = 'forbidden' if e.code == protocol.FORBIDDEN else 'invalid'
+        metrics.commands_total.inc(result=result)
+        trace.set(result=result)
+        with trace.span('reply'):
+            send_reply(conn, addr, protocol.error_reply(str(e), e.code), request_id)
+        return False
+    metrics.parse_duration.observe(time.perf_counter() - parse_started)
+
+    owner = protocol.client_name(conn)
+    try:
+        with trace.span('commit'):
+            expiry = grant_table.grant(rules, client_policy.ttl, owner=owner)
+    except Exception as e:
+        logger.error(f"Error opening {len(rules)} rules for {addr[0]}: {e}")
+        metrics.commands_total.inc(result='failed')
+        trace.set(result='failed')
+        with trace.span('reply'):
+            send_reply(conn, addr, protocol.error_reply("the firewall could not be updated", protocol.UNAVAILABLE), request_id)
+        return False
+    metrics.commands_total.inc(result='granted')
+    metrics.grant_duration.observe(time.perf_counter() - accepted_at)
+    trace.set(result='granted', owner=owner, rules=len(rules))
+    logger.info(f"openmed: {len(rules)} rules opened for {len(request.get('targets', [addr[0]]))} targets requested by {addr[0]}")
+
+    reply = protocol.ok_reply(rules, expiry)
+    if persistent:
+        reply['keepalive'] = config.KEEPALIVE_IDLE_TIMEOUT
+    with trace.span('reply'):
+        sent = send_reply(conn, addr, reply, request_id)
+    return sent and persistent
+
+def send_reply(conn, addr, reply, request_id=None):
+    # Returns False if the reply could not be sent
+    try:
+        protocol.send_reply(conn, reply, request_id)
+    except (ssl.SSLError, OSError) as e:
+        logger.error(f"Error replying to {addr[0]}: {e}")
+        return False
+    return True
+
+def handle_spa_knock(name, addr, data):
+    # Same as a connection, but there is no one to wait for the firewall for
+    ip_address = parse_command(data, addr)
+    client_policy = client_policies.lookup_name(name)
+    if ip_address is None or not authorize(client_policy, name, ip_address, addr):
+        return
+    open_ports(ip_address, client_policy, wait=False, owner=name)
+    metrics.commands_total.inc(result='granted')
+    logger.info(f"openmed: Opening ports for {ip_address} (SPA knock of {name})")
+
+def parse_command(data, addr):
+    # Returns the IP address to open the ports to, or None if the command is not valid
+    if data == "OPEN ME":
+        # Get the IP address of the connecting client
+        return addr[0]
+    elif data.startswith("OPEN "):
+        # Extract the IPv4 or IPv6 address, or network, from the command
+        try:
+            return protocol.parse_target(data[5:].strip())
+        except protocol.ProtocolError as e:
+            # Log an error message for invalid IP address format
+            logger.error(f"Invalid IP address from {addr[0]}: {e}")
+            metrics.commands_total.inc(result='invalid')
+            return None
+    else:
+        # Log an error message for unknown command
+        logger.error(f"Unknown command from ip_address {addr[0]} data: {data}")
+        metrics.commands_total.inc(result='unknown')
+        return None
+
+def authorize(client_policy, name, ip_address, addr):
+    # Returns True if the policy of the client lets it open its ports to ip_address
+    if client_policy is None:
+        logger.error(f"Rejected the command of {name} from {addr[0]}: no policy allows this client")
+    elif ip_address != addr[0] and not client_policy.third_party:
+        logger.error(f"Rejected the command of {name} from {addr[0]}: not allowed to open the ports to {ip_address}")
+    else:
+        return True
+    metrics.commands_total.inc(result='forbidden')
+    return False
+
+def open_ports(ip_address, client_policy, wait=True, owner=None):
+    # Allow incoming connections from the specified IP address to every port
+    # of the policy. All the rules go to the firewall in one commit. Returns
+    # the expiry.
+    rules = [firewall.Rule(ip_address, port, proto) for port in client_policy.ports for proto in client_policy.protos]
+    return grant_table.grant(rules, client_policy.ttl, wait=wait, owner=owner)
+
+def tls_handshake(ssl_context, sock, addr):
+    # Wrap the plain socket and run the handshake within the configured deadline
+    sock.settimeout(config.HANDSHAKE_TIMEOUT)
+    conn = ssl_context.wrap_socket(sock, server_side=True, do_handshake_on_connect=False)
+    try:
+        with metrics.tls_handshake_duration.time():
+            conn.do_handshake()
+    except (ssl.SSLError, OSError) as e:
+        # Covers timeouts (socket.timeout is an OSError) and invalid client certificates
+        logger.error(f"TLS handshake with {addr[0]} failed: {e}")
+        metrics.tls_handshakes_total.inc(result='failed')
+        conn.close()
+        return None
+
+    # Keep count of the sessions resumed
+    metrics.tls_handshakes_total.inc(result='resumed' if conn.session_reused else 'full')
+    if config.DEBUG:
+        resumed = metrics.tls_handshakes_total.value(result='resumed')
+        total = resumed + metrics.tls_handshakes_total.value(result='full')
+        print(f"TLS handshake with {addr[0]} ({'resumed' if conn.session_reused else 'full'}), "
+              f"{resumed} of {total} sessions resumed so far")
+
+    # From now on the client has READ_TIMEOUT seconds to send its command
+    conn.settimeout(config.READ_TIMEOUT)
+    return conn
 
-    # Bind the socket to a specific IP address and port
-    server_socket.bind(('0.0.0.0', config.LISTENING_PORT))
+def worker(connections, tls_context):
+    # Serve connections handed over by the accept loop, one at a time. The
+    # persistent connections handed back by the idle poller are already
+    # established, and skip the handshake
+    while True:
+        sock, addr, accepted_at, established = connections.get()
+        picked_up = time.perf_counter()
+        metrics.accept_wait.observe(picked_up - accepted_at)
+        trace = tracing.start(accepted_at, addr[0])
+        trace.add_span('accept', accepted_at, picked_up)
+        try:
+            if established:
+                conn = sock
+            else:
+                try:
+                    with trace.span('handshake'):
+                        conn = tls_handshake(tls_context.current(), sock, addr)
+                finally:
+                    handshake_limiter.release()
+            if conn is not None:
+                handle_client_connection(conn, addr, accepted_at, trace)
+            else:
+                trace.set(result='handshake_failed')
+        except Exception:
+            logger.exception(f"Error handling connection from {addr[0]}")
+            trace.set(result='error')
+            sock.close()
+        finally:
+            trace.finish()
+            connections.task_done()
+
+def start_workers(connections, tls_context):
+    # Start the pool of threads that serve the client connections
+    for i in range(config.WORKER_THREADS):
+        thread = threading.Thread(target=worker, args=(connections, tls_context), name=f"openmed-worker-{i}", daemon=True)
+        thread.start()
 
+def create_ssl_context():
     # Enable SSL/TLS with the certificate and key files
     ssl_context = ssl.create_default_context(ssl.Purpose.CLIENT_AUTH)
     ssl_context.load_cert_chain(certfile=config.CERT_FILE, keyfile=config.KEY_FILE)
@@ -79,33 +311,283 @@ def main():
     ssl_context.verify_mode = ssl.CERT_REQUIRED
     ssl_context.load_verify_locations(cafile=config.CA_CERT_FILE)
 
-    # Listen for incoming SSL/TLS connections
-    ssl_server_socket = ssl_context.wrap_socket(server_socket, server_side=True)
+    # Reject the client certificates revoked by the CA
+    if config.CRL_FILE:
+        ssl_context.load_verify_locations(cafile=config.CRL_FILE)
+        ssl_context.verify_flags |= ssl.VERIFY_CRL_CHECK_LEAF
+
+    # Only negotiate ECDHE key exchanges
+    ssl_context.set_ciphers(config.TLS_CIPHERS)
+
+    # Let returning clients resume their session and skip the certificate
+    # exchange: session IDs are kept in OpenSSL's server cache (TLS 1.2) and
+    # TLS 1.3 clients get session tickets
+    ssl_context.num_tickets = config.TLS_SESSION_TICKETS
+    return ssl_context
+
+def create_server_socket(reuse_port=False):
+    # Bind a socket to LISTEN_ADDRESS and the port
+    server_socket = protocol.bind_socket(socket.SOCK_STREAM, config.LISTENING_PORT, reuse_port)
+
+    # Listen for incoming connections. The TLS handshake is not done here but
+    # in the workers, so a client that never completes it cannot stall accept()
+    server_socket.listen(config.LISTEN_BACKLOG)
+    return server_socket
+
+def start_grant_service():
+    # Start the thread that applies the rules to the firewall
+    global committer
+    committer = firewall.FirewallCommitter(firewall.create_backend(config.FIREWALL_BACKEND))
+    committer.start()
+
+    # Record the grants on disk, so they survive a restart
+    grant_journal = None
+    if config.GRANT_JOURNAL:
+        grant_journal = journal.GrantJournal(config.GRANT_JOURNAL)
+        grant_journal.start()
+        # Take over the journaled grants that earlier versions left in the
+        # firewall, before anything else updates it
+        committer.backend.migrate(set(grant_journal.load()[0]))
+
+    # Start the thread that revokes the grants once they expire
+    global grant_table
+    grant_table = grants.GrantTable(committer, grant_journal)
+    grant_table.start()
+
+    # Share the grants with the peer gateways
+    if config.PEERS or config.PEER_PORT:
+        import replication
+        grant_table.replicator = replication.Replicator(grant_table)
+        grant_table.replicator.start()
+
+    # Pick up the rules granted before a restart, so they are not added twice
+    # and expire when they were meant to
+    started = time.perf_counter()
+    restored, added, removed = grant_table.recover(committer.backend.list_rules())
+    logger.info(f"openmed: Recovered {restored} rules granted before the start in {time.perf_counter() - started:.3f}s "
+                f"({added} added back to the firewall, {removed} expired rules removed)")
 
-    # Listen for incoming connections
-    ssl_server_socket.listen(1)
+    # Remove the rules left in the firewall that are not granted
+    committer.active_rules = grant_table.active_rules
+
+    metrics.firewall_queue_depth.function = committer.pending.qsize
+    metrics.active_grants.function = lambda: len(grant_table.expiries)
+
+    # Send the traces kept to the collector
+    if config.TRACE_OTLP_ENDPOINT:
+        tracing.start_export(config.TRACE_OTLP_ENDPOINT)
+
+    # Let the administrators list and revoke the grants, and dump the traces
+    if config.ADMIN_SOCKET:
+        admin.AdminServer(config.ADMIN_SOCKET, grant_table).start()
+        logger.info(f"openmed: Listening for administration commands on {config.ADMIN_SOCKET}")
+
+    # Listen for single packet knocks if enabled
+    if config.SPA_PORT:
+        import spa
+        spa_limiter = None
+        if config.RATE_LIMIT_RATE:
+            spa_limiter = ratelimit.TokenBucketLimiter(config.RATE_LIMIT_RATE, config.RATE_LIMIT_BURST, config.RATE_LIMIT_MAX_SOURCES)
+        global spa_listener
+        spa_listener = spa.SpaListener(spa.create_socket(), config.SPA_KEYS_DIR, handle_spa_knock, spa_limiter)
+        spa_listener.start()
+        logger.info(f"openmed: Listening for SPA knocks on UDP port {config.SPA_PORT} with {len(spa_listener.keys)} keys")
+
+def serve(server_socket, tls_context):
+    # Admission control, applied before the TLS handshake
+    global handshake_limiter
+    handshake_limiter = ratelimit.HandshakeLimiter(config.MAX_PENDING_HANDSHAKES)
+    source_limiter = None
+    if config.RATE_LIMIT_RATE:
+        source_limiter = ratelimit.TokenBucketLimiter(config.RATE_LIMIT_RATE, config.RATE_LIMIT_BURST, config.RATE_LIMIT_MAX_SOURCES)
+
+    # Accepted connections wait here until a worker picks them up
+    connections = queue.Queue(maxsize=config.WORKER_QUEUE_SIZE)
+    start_workers(connections, tls_context)
+    metrics.queue_depth.function = connections.qsize
+
+    # Idle persistent connections go back to the workers with their next request
+    def resume(conn, addr):
+        try:
+            connections.put_nowait((conn, addr, time.perf_counter(), True))
+        except queue.Full:
+            logger.error(f"Worker queue full, closing the persistent connection from {addr[0]}")
+            conn.close()
+
+    global idle_connections
+    if config.KEEPALIVE_MAX_CONNECTIONS:
+        idle_connections = keepalive.IdleConnections(resume)
+        idle_connections.start()
+        metrics.idle_connections.function = lambda: len(idle_connections)
 
     while True:
         # Accept a connection
-        conn, addr = ssl_server_socket.accept()
+        try:
+            sock, addr = server_socket.accept()
+        except OSError as e:
+            logger.error(f"Error accepting connection: {e}")
+            continue
+        addr = protocol.client_address(addr)
+
+        # Reset the connections of the sources over their rate, and the ones
+        # beyond the cap of pending handshakes. This must stay cheap: it is
+        # what protects the daemon from scanners.
+        if source_limiter is not None and not source_limiter.allow(addr[0]):
+            metrics.connections_total.inc(result='rate_limited')
+            ratelimit.reject(sock)
+            continue
+        if not handshake_limiter.acquire():
+            metrics.connections_total.inc(result='handshake_limited')
+            ratelimit.reject(sock)
+            continue
+
+        # Hand the connection over to a worker, or drop it if all are busy
+        try:
+            connections.put_nowait((sock, addr, time.perf_counter(), False))
+            metrics.connections_total.inc(result='accepted')
+        except queue.Full:
+            logger.error(f"Worker queue full, dropping connection from {addr[0]}")
+            metrics.connections_total.inc(result='dropped')
+            handshake_limiter.release()
+            ratelimit.reject(sock)
 
-        # Handle the client connection in a separate function
-        handle_client_connection(conn, addr)
+# Settings only read at startup. A reload keeps their current values, so the
+# workers forked after a reload in multi-process mode run with the same ones as
+# the writer and the master
+STARTUP_SETTINGS = {
+    'LISTENING_PORT', 'LISTEN_ADDRESS', 'LISTEN_BACKLOG', 'WORKER_THREADS', 'WORKER_PROCESSES',
+    'WORKER_QUEUE_SIZE', 'GRANT_JOURNAL', 'ADMIN_SOCKET', 'SPA_PORT', 'PEER_PORT', 'FIREWALL_BACKEND',
+    'METRICS_PORT', 'METRICS_ADDRESS', 'LOG_BACKEND', 'SYSLOG_ADDRESS', 'LOG_FILE',
+    'RATE_LIMIT_RATE', 'RATE_LIMIT_BURST', 'RATE_LIMIT_MAX_SOURCES',
+}
+
+def load_settings():
+    # Run config.py again, in a module of its own, and return its settings
+    spec = importlib.util.spec_from_file_location('config', config.__file__)
+    module = importlib.util.module_from_spec(spec)
+    spec.loader.exec_module(module)
+    return {name: value for name, value in vars(module).items() if name.isupper() and name not in STARTUP_SETTINGS}
+
+def reload_settings():
+    # Reload config.py and what is built from it: the client policies, the TLS
+    # context, the firewall setup and the SPA keys. If config.py does not load,
+    # or has an invalid policy, nothing changes. The settings read only at
+    # startup, such as the listening address, the pool sizes or the backends,
+    # still need a restart.
+    global client_policies
+    try:
+        settings = load_settings()
+        policies = compile_policies(settings)
+    except Exception as e:
+        logger.error(f"openmed: Not reloading {config.__file__}: {e}")
+        return
+    # All the settings change in one dict update, so no request sees half of them
+    vars(config).update(settings)
+    client_policies = policies
+
+    # New connections get the new context, the ones in progress keep the old one
+    if tls_context is not None:
+        tls_context.reload()
+    # Protect the new OPEN_PORTS
+    if committer is not None:
+        try:
+            committer.backend.setup()
+        except Exception as e:
+            logger.error(f"openmed: Could not set up the firewall again: {e}")
+    if spa_listener is not None:
+        spa_listener.reload_keys(config.SPA_KEYS_DIR)
+    logger.info(f"openmed: Reloaded {config.__file__}")
+
+def compile_policies(settings=None):
+    # The policies of the clients, from the given settings or the current ones
+    settings = vars(config) if settings is None else settings
+    return policy.PolicyTable(settings.get('POLICIES', {}), settings.get('DEFAULT_POLICY', {}), settings['OPEN_PORTS'])
+
+def handle_sighup(signum, frame):
+    # Reload in the background, so accepting connections does not wait for it
+    threading.Thread(target=reload_settings, name='openmed-reload', daemon=True).start()
+
+def run_writer(address, authkey):
+    # Firewall writer of the multi-process mode: owns the grant table and
+    # applies the grants sent by the workers. It serves no TLS clients
+    global tls_context
+    tls_context = None
+    logqueue.setup_logging(logger)
+    signal.signal(signal.SIGHUP, handle_sighup)
+    start_grant_service()
+    if config.METRICS_PORT:
+        metrics.start_http_server(config.METRICS_ADDRESS, config.METRICS_PORT)
+    prefork.GrantServer(address, authkey, grant_table, tracing.record).serve_forever()
+
+def run_worker(index, address, authkey):
+    # Worker of the multi-process mode: handles connections, and forwards the
+    # grants to the firewall writer. The master replaces the workers to reload
+    # the settings or the TLS context, so they ignore SIGHUP
+    global grant_table
+    logqueue.setup_logging(logger)
+    grant_table = prefork.GrantClient(address, authkey)
+    # The traces are kept by the writer, with the administration socket
+    tracing.start_forwarding(grant_table.record_traces)
+    # Each process has its own metrics, worker i exports them on METRICS_PORT + 1 + i
+    if config.METRICS_PORT:
+        metrics.start_http_server(config.METRICS_ADDRESS, config.METRICS_PORT + 1 + index)
+    serve(create_server_socket(reuse_port=True), tls_context)
+
+def main():
+    print("main")
+
+    global tls_context, client_policies
+    client_policies = compile_policies()
+    if config.WORKER_PROCESSES > 1:
+        # The master only supervises the children, and logs synchronously
+        # since it must not start any thread before forking
+        logqueue.setup_logging(logger, background=False)
+        # The TLS context is created before forking, so all the workers share
+        # the session ticket keys and resume the sessions started by the others.
+        # Only the master reloads it, without threads, and forks new workers
+        # with the new one (see prefork.py)
+        tls_context = tlscontext.ReloadingContext(create_ssl_context)
+        # Fail now if another daemon has the port: the workers bind it with
+        # SO_REUSEPORT, which would let them share it
+        create_server_socket().close()
+        prefork.run(config.WORKER_PROCESSES, run_writer, run_worker, reload_settings, tls_context.check)
+        return
+
+    # Write the logs in the background, so the request path never waits for them
+    logqueue.setup_logging(logger)
+    signal.signal(signal.SIGHUP, handle_sighup)
+
+    # Bind the port first, so a second daemon fails before touching anything
+    server_socket = create_server_socket()
+    start_grant_service()
+    if config.METRICS_PORT:
+        metrics.start_http_server(config.METRICS_ADDRESS, config.METRICS_PORT)
+    tls_context = tlscontext.ReloadingContext(create_ssl_context)
+    # Pick up the changes of the revocation list
+    tls_context.start()
+    serve(server_socket, tls_context)
+
+# Firewall updates go through this committer, and the grants are tracked in
+# this table. Both are created in main()
+committer = None
+grant_table = None
+
+# Caps the connections waiting for, or running, their TLS handshake
+handshake_limiter = None
+
+# Persistent connections waiting for their next request, None if disabled
+idle_connections = None
+
+# TLS context of the new connections and policies of the clients, reloaded on
+# SIGHUP, and the listener of SPA knocks if enabled
+tls_context = None
+client_policies = None
+spa_listener = None
 
 # Create a logger instance
 logger = logging.getLogger('openme_logger')
 logger.setLevel(logging.INFO)
 
-# Create a syslog handler and set its level
-#syslog_handler = logging.handlers.SysLogHandler(address='/dev/log')
-#syslog_handler.setLevel(logging.INFO)
-
-# Create a formatter and set it for the handler
-#formatter = logging.Formatter('%(name)s: %(message)s')
-#syslog_handler.setFormatter(formatter)
-
-# Add the handler to the logger
-#logger.addHandler(syslog_handler)
 
 def run_as_daemon():
     #print("daemon")
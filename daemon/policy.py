@@ -0,0 +1,92 @@
+"""
+Authorization policies of the clients, by certificate subject.
+
+config.POLICIES maps "CN=<common name>" or "OU=<organizational unit>" to what
+the matching clients may open: their ports (among config.OPEN_PORTS), protocols,
+grant TTL, and whether they may open the ports to other addresses than their
+own ("OPEN <ip>", or other targets in a JSON request). A policy on the common
+name wins over one on the unit. Clients that match none get
+config.DEFAULT_POLICY, or are rejected if it is None.
+
+The policies are checked and compiled when the configuration is loaded, into a
+dict keyed by certificate attribute. The policy found for a subject is then
+remembered, so authorizing a request is a single dict lookup on the subject of
+the peer certificate.
+"""
+
+import collections
+
+import protocol
+
+# Certificate attributes a policy can be keyed by, in order of precedence
+ATTRIBUTES = {'CN': 'commonName', 'OU': 'organizationalUnitName'}
+KEYS = {'ports', 'protos', 'ttl', 'third_party'}
+# Largest number of subjects whose policy is remembered
+CACHE_SIZE = 100000
+
+# ttl is None for config.GRANT_TTL
+Policy = collections.namedtuple('Policy', 'ports protos ttl third_party')
+
+def compile_policy(name, spec, open_ports):
+    # Checks a policy of the configuration. Missing keys allow everything.
+    if not isinstance(spec, dict) or not KEYS.issuperset(spec):
+        raise ValueError(f"policy {name} must be a dict with keys among {', '.join(sorted(KEYS))}")
+    ports = tuple(spec.get('ports', open_ports))
+    for port in ports:
+        if port not in open_ports:
+            raise ValueError(f"policy {name}: port {port} is not in OPEN_PORTS")
+    protos = tuple(spec.get('protos', protocol.PROTOCOLS))
+    for proto in protos:
+        if proto not in protocol.PROTOCOLS:
+            raise ValueError(f"policy {name}: invalid protocol {proto}")
+    # A grant of ttl 0 would never expire, which must not be a typo away
+    ttl = spec.get('ttl')
+    if ttl is not None and (isinstance(ttl, bool) or not isinstance(ttl, (int, float)) or not ttl > 0):
+        raise ValueError(f"policy {name}: invalid ttl {ttl}, expected a number of seconds above 0")
+    third_party = spec.get('third_party', True)
+    if not isinstance(third_party, bool):
+        raise ValueError(f"policy {name}: invalid third_party {third_party!r}, expected True or False")
+    return Policy(ports, protos, ttl, third_party)
+
+class PolicyTable:
+    """
+    The compiled policies. Raises ValueError if one of them is not valid, so a
+    reload with a broken policy keeps the current table.
+    """
+
+    def __init__(self, policies, default, open_ports):
+        # (attribute, value) -> Policy
+        self.policies = {}
+        for key, spec in policies.items():
+            attribute, _, value = key.partition('=')
+            if attribute not in ATTRIBUTES or not value:
+                raise ValueError(f"invalid policy {key}, expected CN=<name> or OU=<name>")
+            self.policies[ATTRIBUTES[attribute], value] = compile_policy(key, spec, open_ports)
+        self.default = None if default is None else compile_policy('DEFAULT_POLICY', default, open_ports)
+        # subject -> Policy, filled as clients connect
+        self.by_subject = {}
+
+    def lookup(self, subject):
+        # Policy of a certificate subject, as returned by getpeercert(). None
+        # if the client is not authorized at all.
+        try:
+            return self.by_subject[subject]
+        except KeyError:
+            pass
+        policy = self.resolve(subject)
+        if len(self.by_subject) >= CACHE_SIZE:
+            self.by_subject.clear()
+        self.by_subject[subject] = policy
+        return policy
+
+    def lookup_name(self, name):
+        # Policy of an SPA key, named after the common name of its client
+        return self.lookup(((('commonName', name),),))
+
+    def resolve(self, subject):
+        attributes = [attribute for rdn in subject for attribute in rdn]
+        for wanted in ATTRIBUTES.values():
+            for attribute in attributes:
+                if attribute[0] == wanted and attribute in self.policies:
+                    return self.policies[attribute]
+        return self.default
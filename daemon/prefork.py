@@ -0,0 +1,203 @@
+"""
+Multi-process mode of openmed (config.WORKER_PROCESSES > 1).
+
+The master process only forks and supervises the children. It starts:
+ - one firewall writer, which owns the firewall backend and the grant table,
+   so the firewall updates stay serialized in a single process;
+ - WORKER_PROCESSES workers, each one with its own listening socket bound with
+   SO_REUSEPORT, so the kernel spreads the connections across them and the
+   TLS handshakes run on all the cores.
+
+Workers send their grants to the writer over a Unix socket with GrantClient,
+which has the same grant() method as grants.GrantTable, and their traces (see
+tracing.py). Children that die are
+started again. The master never starts any thread, so forking is safe.
+
+The master owns the reloads of the settings and of the TLS context. On SIGHUP
+it reloads its own settings and forwards the signal to the writer, and when
+the CRL changes it builds a new TLS context. Either way, it then replaces the
+workers with new ones forked from it, so all the workers run the same settings
+and share the session ticket keys of the same context: a session started on
+one worker resumes on any other. The new workers bind the port before the old
+ones are stopped. The connections the old ones were still serving are closed,
+and the clients knock again.
+"""
+
+import logging
+import os
+import signal
+import threading
+import time
+from multiprocessing.connection import Listener, Client
+
+logger = logging.getLogger('openme_logger')
+
+# Seconds between two polls of the master for exited children and reloads
+POLL_INTERVAL = 0.5
+
+class GrantServer:
+    """
+    Runs in the writer. Serves the grant requests of the workers, one thread
+    per worker connection, and hands their traces to record_traces.
+    """
+
+    def __init__(self, address, authkey, grant_table, record_traces=None):
+        self.listener = Listener(address, family='AF_UNIX', authkey=authkey)
+        # The methods the workers may call
+        self.methods = {'grant': grant_table.grant}
+        if record_traces is not None:
+            self.methods['record_traces'] = record_traces
+
+    def serve_forever(self):
+        while True:
+            try:
+                conn = self.listener.accept()
+            except Exception as e:
+                logger.error(f"Error accepting a worker connection: {e}")
+                continue
+            threading.Thread(target=self.serve, args=(conn,), name='openmed-grant-server', daemon=True).start()
+
+    def serve(self, conn):
+        with conn:
+            while True:
+                try:
+                    method, args, kwargs = conn.recv()
+                except (EOFError, OSError):
+                    return
+                if method not in self.methods:
+                    conn.send(('error', f"unknown method {method}"))
+                    continue
+                try:
+                    conn.send(('ok', self.methods[method](*args, **kwargs)))
+                except Exception as e:
+                    conn.send(('error', str(e)))
+
+class GrantClient:
+    """
+    Runs in the workers. Forwards the grants to the writer, over one connection
+    per thread. Reconnects once if the writer was restarted.
+    """
+
+    def __init__(self, address, authkey):
+        self.address = address
+        self.authkey = authkey
+        self.local = threading.local()
+
+    def call(self, method, *args, **kwargs):
+        for attempt in range(2):
+            conn = getattr(self.local, 'conn', None)
+            try:
+                if conn is None:
+                    conn = self.local.conn = Client(self.address, family='AF_UNIX', authkey=self.authkey)
+                conn.send((method, args, kwargs))
+                status, result = conn.recv()
+                break
+            except (EOFError, OSError):
+                self.local.conn = None
+                if attempt == 1:
+                    raise
+        if status != 'ok':
+            raise RuntimeError(result)
+        return result
+
+    def grant(self, *args, **kwargs):
+        return self.call('grant', *args, **kwargs)
+
+    def record_traces(self, traces):
+        return self.call('record_traces', traces)
+
+def run(workers, writer_main, worker_main, reload=None, check=None):
+    """
+    Forks the writer, running writer_main(address, authkey), and the workers,
+    running worker_main(index, address, authkey), then restarts the ones that
+    exit. On SIGHUP, reload() is called, the signal is forwarded to the writer
+    and the workers are replaced. check() is called on every poll, and the
+    workers are replaced too when it returns True.
+    """
+    # Abstract Unix socket, only reachable with the key shared with the children
+    address = f"\0openmed-grants-{os.getpid()}"
+    authkey = os.urandom(32)
+    children = {}
+
+    def spawn(role, index):
+        pid = os.fork()
+        if pid == 0:
+            # Child: never return into the master code
+            status = 1
+            try:
+                signal.signal(signal.SIGTERM, signal.SIG_DFL)
+                signal.signal(signal.SIGINT, signal.SIG_DFL)
+                # Until the child installs its own handler
+                signal.signal(signal.SIGHUP, signal.SIG_IGN)
+                if role == 'writer':
+                    writer_main(address, authkey)
+                else:
+                    worker_main(index, address, authkey)
+                status = 0
+            except BaseException:
+                logger.exception(f"openmed: {role} {index} crashed")
+            finally:
+                os._exit(status)
+        children[pid] = (role, index)
+
+    def terminate(signum, frame):
+        for pid in children:
+            try:
+                os.kill(pid, signal.SIGTERM)
+            except ProcessLookupError:
+                pass
+        os._exit(0)
+
+    def replace_workers():
+        # Fork the new workers first, so the port always has listeners
+        old = [pid for pid, (role, _) in children.items() if role == 'worker']
+        for pid in old:
+            del children[pid]
+        for index in range(workers):
+            spawn('worker', index)
+        for pid in old:
+            try:
+                os.kill(pid, signal.SIGTERM)
+            except ProcessLookupError:
+                pass
+        logger.info(f"openmed: Replaced the {workers} workers")
+
+    hangups = 0
+
+    def hangup(signum, frame):
+        # Handled by the loop below, so a reload never runs in the middle of a spawn()
+        nonlocal hangups
+        hangups += 1
+
+    signal.signal(signal.SIGTERM, terminate)
+    signal.signal(signal.SIGINT, terminate)
+    signal.signal(signal.SIGHUP, hangup)
+
+    spawn('writer', 0)
+    for index in range(workers):
+        spawn('worker', index)
+    logger.info(f"openmed: Started the firewall writer and {workers} workers")
+
+    while True:
+        pid, status = os.waitpid(-1, os.WNOHANG)
+        if pid == 0:
+            if hangups:
+                hangups = 0
+                if reload is not None:
+                    reload()
+                for pid, (role, _) in children.items():
+                    if role == 'writer':
+                        os.kill(pid, signal.SIGHUP)
+                replace_workers()
+            elif check is not None and check():
+                replace_workers()
+            time.sleep(POLL_INTERVAL)
+            continue
+        # Workers already replaced by new ones
+        role, index = children.pop(pid, (None, None))
+        if role is None:
+            continue
+        logger.error(f"openmed: {role} {index} (pid {pid}) exited with status {status}, restarting it")
+        # Do not spin if the child dies right away
+        time.sleep(1)
+        spawn(role, index)
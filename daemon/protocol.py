@@ -0,0 +1,250 @@
+"""
+Versioned JSON requests of the knock protocol.
+
+Besides the plain text "OPEN ME" and "OPEN <ip>" commands, a client can send
+one JSON object terminated by a newline. It gets one JSON object back, also
+terminated by a newline. Version 1 has a single operation, a bulk grant:
+
+  {"v": 1, "op": "open", "targets": ["10.0.0.5", "10.1.0.0/24"],
+   "ports": [80, "8000-8010"], "protos": ["tcp"]}
+
+targets defaults to the address of the client, ports and protos to the ones
+its policy allows (see policy.py), by default config.OPEN_PORTS and tcp and
+udp. Every port and protocol must be allowed by the policy, and so must targets
+other than the address of the client. The whole
+request is validated before anything is granted, and all its rules are applied
+in one firewall commit. The reply is {"v": 1, "status": "ok", "code": 200,
+"rules": <number of rules>, "expires": <unix time or null>} or {"v": 1,
+"status": "error", "code": <code>, "error": "..."}. The codes follow HTTP:
+ - 400: the request is malformed;
+ - 403: the request is valid, but asks for ports or networks that cannot be
+   opened, or that the policy of the client does not allow;
+ - 413: the request is too large, or opens too many rules;
+ - 505: the version is not supported;
+ - 503: the firewall could not be updated. Only this one is worth retrying.
+A request may have an "id", a string or an integer, which is copied into its
+reply, unless the request is not valid JSON of a supported version.
+
+With "keepalive": true the daemon does not close the connection after the
+reply, and the client can send its next request, typically the same one as a
+heartbeat that extends the grant, on the same connection. The reply then has
+"keepalive": <seconds>, how long the connection may stay idle before the daemon
+closes it. Without it, the connection is closed once the request is served.
+Requests on a persistent connection can be pipelined: the client may send
+several of them without waiting, and the replies come back in the same order.
+"""
+
+import errno
+import ipaddress
+import json
+import logging
+import math
+import socket
+
+import config
+import firewall
+
+logger = logging.getLogger('openme_logger')
+
+VERSION = 1
+PROTOCOLS = ('tcp', 'udp')
+
+# Status codes of the replies
+OK = 200
+BAD_REQUEST = 400
+FORBIDDEN = 403
+TOO_LARGE = 413
+UNAVAILABLE = 503
+UNSUPPORTED_VERSION = 505
+
+class ProtocolError(Exception):
+
+    def __init__(self, message, code=BAD_REQUEST):
+        super().__init__(message)
+        self.code = code
+
+class LineReader:
+    """
+    Splits what is received on a connection into lines, one request each, so
+    that several requests can be pipelined on the connection.
+    """
+
+    def __init__(self, conn, data=b''):
+        self.conn = conn
+        self.buffer = data
+
+    def read_line(self):
+        # Next line, without the newline. The last line may have none. None
+        # once the client has closed the connection.
+        while b'\n' not in self.buffer:
+            if len(self.buffer) > config.MAX_REQUEST_SIZE:
+                raise ProtocolError(f"request larger than {config.MAX_REQUEST_SIZE} bytes", TOO_LARGE)
+            chunk = self.conn.recv(4096)
+            if not chunk:
+                line, self.buffer = self.buffer, b''
+                return line or None
+            self.buffer += chunk
+        line, self.buffer = self.buffer.split(b'\n', 1)
+        if len(line) > config.MAX_REQUEST_SIZE:
+            raise ProtocolError(f"request larger than {config.MAX_REQUEST_SIZE} bytes", TOO_LARGE)
+        return line
+
+    def buffered(self):
+        # True if part of the next request has already been received
+        return bool(self.buffer.strip())
+
+def send_reply(conn, reply, request_id=None):
+    if request_id is not None:
+        reply = dict(reply, id=request_id)
+    conn.sendall(json.dumps(dict(v=VERSION, **reply)).encode() + b'\n')
+
+def ok_reply(rules, expiry):
+    return {'status': 'ok', 'code': OK, 'rules': len(rules), 'expires': None if expiry == math.inf else expiry}
+
+def error_reply(message, code=BAD_REQUEST):
+    return {'status': 'error', 'code': code, 'error': message}
+
+def parse_request(line):
+    # Decodes a JSON request and checks its version
+    try:
+        request = json.loads(line)
+    except ValueError as e:
+        raise ProtocolError(f"invalid JSON: {e}")
+    if not isinstance(request, dict):
+        raise ProtocolError("the request must be a JSON object")
+    if request.get('v') != VERSION:
+        raise ProtocolError(f"unsupported version {request.get('v')}", UNSUPPORTED_VERSION)
+    return request
+
+def parse_request_id(request):
+    # The id of the request to copy into its reply, None if it has none
+    request_id = request.get('id')
+    if request_id is not None and (isinstance(request_id, bool) or not isinstance(request_id, (str, int))):
+        raise ProtocolError("id must be a string or an integer")
+    return request_id
+
+def listen_address():
+    # (family, address) to bind for LISTEN_ADDRESS. The dual-stack "::" falls
+    # back to IPv4 when the kernel has no IPv6 (ipv6.disable=1)
+    if ':' not in config.LISTEN_ADDRESS:
+        return socket.AF_INET, config.LISTEN_ADDRESS
+    try:
+        socket.socket(socket.AF_INET6, socket.SOCK_STREAM).close()
+    except OSError as e:
+        if config.LISTEN_ADDRESS != '::' or e.errno != errno.EAFNOSUPPORT:
+            raise
+        logger.warning("openmed: IPv6 is not available, listening on 0.0.0.0")
+        return socket.AF_INET, '0.0.0.0'
+    return socket.AF_INET6, config.LISTEN_ADDRESS
+
+def bind_socket(kind, port, reuse_port=False):
+    # Socket of type kind bound to LISTEN_ADDRESS and port. With an IPv6
+    # address it is dual-stack, and IPv4 clients reach it too
+    family, address = listen_address()
+    sock = socket.socket(family, kind)
+    if family == socket.AF_INET6:
+        sock.setsockopt(socket.IPPROTO_IPV6, socket.IPV6_V6ONLY, 0)
+
+    # Restart while the connections of the previous run are in TIME_WAIT
+    if kind == socket.SOCK_STREAM:
+        sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+
+    # In multi-process mode every worker binds its own socket to the port,
+    # and the kernel spreads the connections among them
+    if reuse_port:
+        sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEPORT, 1)
+    sock.bind((address, port))
+    return sock
+
+def client_address(addr):
+    # Address of a client as the firewall sees it: IPv4 clients of the
+    # dual-stack socket (::ffff:1.2.3.4) are plain IPv4 addresses
+    if addr[0].startswith('::ffff:') and '.' in addr[0]:
+        return (addr[0][7:],) + tuple(addr[1:])
+    return addr
+
+def client_subject(conn):
+    # Subject of the client certificate, as a tuple of relative distinguished names
+    return (conn.getpeercert() or {}).get('subject', ())
+
+def client_name(conn):
+    # Common name of the client certificate, which owns the grants of the
+    # connection. None if there is none.
+    for rdn in client_subject(conn):
+        for key, value in rdn:
+            if key == 'commonName':
+                return value
+    return None
+
+def parse_target(target):
+    # An IPv4 or IPv6 address or network, normalized as the firewall backends
+    # expect it. Anything ipaddress does not parse strictly is rejected.
+    if not isinstance(target, str):
+        raise ProtocolError(f"invalid target {target}")
+    try:
+        network = ipaddress.ip_network(target, strict=False)
+    except ValueError:
+        raise ProtocolError(f"invalid target {target}")
+    min_prefixlen = config.BULK_MIN_PREFIXLEN if network.version == 4 else config.BULK_MIN_PREFIXLEN6
+    if network.prefixlen < min_prefixlen:
+        raise ProtocolError(f"target {target} is wider than /{min_prefixlen}", FORBIDDEN)
+    return firewall.normalize_source(network.with_prefixlen)
+
+def parse_port(port, request):
+    # A port number from 1 to 65535, an integer or a string of ASCII digits.
+    # request is the port or range it comes from, for the error
+    if isinstance(port, str) and port.isascii() and port.isdigit():
+        port = int(port)
+    if isinstance(port, bool) or not isinstance(port, int) or not 0 < port < 65536:
+        raise ProtocolError(f"invalid port {request!r}")
+    return port
+
+def parse_ports(ports, allowed):
+    # Ports and "first-last" ranges, all of them in allowed
+    parsed = []
+    for port in ports:
+        if isinstance(port, str) and '-' in port:
+            first, _, last = port.partition('-')
+            first, last = parse_port(first, port), parse_port(last, port)
+        else:
+            first = last = parse_port(port, port)
+        if last < first:
+            raise ProtocolError(f"invalid port range {port}")
+        for number in range(first, last + 1):
+            if number not in allowed:
+                raise ProtocolError(f"port {number} cannot be opened", FORBIDDEN)
+            parsed.append(number)
+    return parsed
+
+def parse_open_request(request, source, policy):
+    # Rules of a bulk grant, after validating all of them against the policy
+    # of the client. source is the address of the client, the default target
+    targets = request.get('targets', [source])
+    if not isinstance(targets, list) or not targets:
+        raise ProtocolError("targets must be a non empty list")
+    ports = request.get('ports', list(policy.ports))
+    protos = request.get('protos', list(policy.protos))
+    if not isinstance(ports, list) or not isinstance(protos, list):
+        raise ProtocolError("ports and protos must be lists")
+    for proto in protos:
+        if proto not in PROTOCOLS:
+            raise ProtocolError(f"invalid protocol {proto}")
+        if proto not in policy.protos:
+            raise ProtocolError(f"protocol {proto} cannot be opened", FORBIDDEN)
+
+    sources = [parse_target(target) for target in targets]
+    if not policy.third_party and any(target != source for target in sources):
+        raise ProtocolError("only the address of the client can be opened", FORBIDDEN)
+    ports = parse_ports(ports, policy.ports)
+    rules = list(dict.fromkeys(firewall.Rule(source, port, proto)
+                               for source in sources for port in ports for proto in protos))
+    if len(rules) > config.BULK_MAX_RULES:
+        raise ProtocolError(f"{len(rules)} rules requested, the limit is {config.BULK_MAX_RULES}", TOO_LARGE)
+    return rules
+
+def wants_keepalive(request):
+    # True if the client asked to keep the connection open after the reply
+    keepalive = request.get('keepalive', False)
+    if not isinstance(keepalive, bool):
+        raise ProtocolError("keepalive must be true or false")
+    return keepalive
@@ -0,0 +1,82 @@
+"""
+Admission control run right after accepting a TCP connection, before spending
+any CPU on the TLS handshake.
+
+Connections are limited per source address with a token bucket, and the
+number of handshakes pending in the daemon is capped globally. Rejected
+connections are reset instead of closed, so they do not leave a socket in
+TIME_WAIT behind.
+"""
+
+import ipaddress
+import socket
+import struct
+import threading
+import time
+from collections import OrderedDict
+
+class TokenBucketLimiter:
+    """
+    Allows each source `rate` connections per second, with bursts of up to
+    `burst` connections. Only the `max_sources` most recently seen sources are
+    tracked, so a scan from many addresses cannot exhaust the memory.
+    """
+
+    def __init__(self, rate, burst, max_sources):
+        self.rate = rate
+        self.burst = burst
+        self.max_sources = max_sources
+        # source -> [tokens, time of the last update], least recently seen first
+        self.buckets = OrderedDict()
+        self.lock = threading.Lock()
+
+    def allow(self, source):
+        source = source_key(source)
+        now = time.monotonic()
+        with self.lock:
+            bucket = self.buckets.get(source)
+            if bucket is None:
+                bucket = self.buckets[source] = [self.burst, now]
+                if len(self.buckets) > self.max_sources:
+                    self.buckets.popitem(last=False)
+            else:
+                self.buckets.move_to_end(source)
+                bucket[0] = min(self.burst, bucket[0] + (now - bucket[1]) * self.rate)
+                bucket[1] = now
+            if bucket[0] < 1:
+                return False
+            bucket[0] -= 1
+            return True
+
+def source_key(address):
+    # IPv6 sources are limited per /64, the smallest network a host gets, so
+    # a client cannot get a fresh bucket for each of its addresses
+    if ':' not in address:
+        return address
+    if address.startswith('::ffff:') and '.' in address:
+        return address[7:]
+    return ipaddress.IPv6Address(address).packed[:8]
+
+class HandshakeLimiter:
+    """
+    Caps the number of connections accepted but not done with their TLS
+    handshake, whether waiting for a worker or in the middle of the handshake.
+    """
+
+    def __init__(self, max_pending):
+        self.slots = threading.BoundedSemaphore(max_pending)
+
+    def acquire(self):
+        # Takes a slot if there is one free, without waiting
+        return self.slots.acquire(blocking=False)
+
+    def release(self):
+        self.slots.release()
+
+def reject(sock):
+    # Close the connection with a RST (SO_LINGER with a zero timeout)
+    try:
+        sock.setsockopt(socket.SOL_SOCKET, socket.SO_LINGER, struct.pack('ii', 1, 0))
+    except OSError:
+        pass
+    sock.close()
@@ -0,0 +1,290 @@
+"""
+Replication of the grants between openmed gateways, e.g. behind anycast, so a
+knock on one of them opens the ports on all of them.
+
+Each gateway connects to every one of config.PEERS over mutual TLS. Both ends
+present a certificate issued by the CA (see add_peer.sh) and only accept the
+common names in config.PEER_NAMES, so a client certificate cannot be used to
+inject grants. Messages are JSON lines:
+
+  {"v": 1, "id": "<node>-<sequence>", "grants": [[ip, port, proto, expiry, owner], ...]}
+  {"v": 1, "id": "<node>-<sequence>", "revokes": [[ip, port, proto, expiry], ...]}
+
+where expiry is a unix time, or null for grants that never expire, and owner
+the name of the client that asked for the grant, or null. Local grants
+are batched and sent to each peer by a thread of its own, so a slow peer does
+not hold up the others. A peer merges the grants it receives, keeping the
+latest expiry of each rule, and does not send them any further. Receiving the
+same grants twice changes nothing, and message ids already seen are skipped,
+since the message in flight when a connection drops is sent again.
+
+Anti-entropy: on every (re)connection, and then every config.PEER_RESYNC_INTERVAL
+seconds, all the active grants are sent to the peer, which covers the messages
+lost while it was unreachable. Expiries are absolute, so the clocks of the
+gateways must be in sync. Each gateway revokes the expired grants on its own.
+
+Grants revoked before they expire (see admin.py) are revoked on the peers too,
+unless granted again since with a later expiry. A revoked grant is remembered
+for 2 * config.PEER_RESYNC_INTERVAL seconds, so a resync from a peer that has
+not received the revocation yet does not bring it back.
+"""
+
+import collections
+import itertools
+import json
+import logging
+import math
+import os
+import queue
+import random
+import socket
+import ssl
+import threading
+import time
+
+import config
+import firewall
+import metrics
+import protocol
+
+logger = logging.getLogger('openme_logger')
+
+VERSION = 1
+# Largest number of grants per message
+BATCH_SIZE = 500
+# Number of message ids remembered to skip the duplicates
+SEEN_IDS = 100000
+# Longest wait, in seconds, before connecting again to a peer
+MAX_BACKOFF = 60
+
+replicated_grants = metrics.Counter('openmed_replicated_grants_total', 'Grants sent to and received from the peers')
+
+def create_context(purpose):
+    # Peers verify each other against the CA. Names are checked by peer_name()
+    context = ssl.create_default_context(purpose, cafile=config.CA_CERT_FILE)
+    context.check_hostname = False
+    context.verify_mode = ssl.CERT_REQUIRED
+    context.load_cert_chain(certfile=config.PEER_CERT_FILE, keyfile=config.PEER_KEY_FILE)
+    return context
+
+def peer_name(conn):
+    # Common name of the certificate of the other end, None unless it is one of PEER_NAMES
+    for rdn in conn.getpeercert().get('subject', ()):
+        for key, value in rdn:
+            if key == 'commonName' and value in config.PEER_NAMES:
+                return value
+    return None
+
+def encode_grants(grants):
+    return [[rule.ip, rule.port, rule.proto, None if expiry == math.inf else expiry, owner]
+            for rule, expiry, owner in grants]
+
+def decode_grants(grants):
+    # rule -> expiry and rule -> owner of the valid grants. Ports that are not
+    # in the local OPEN_PORTS are ignored, gateways may not open the same ones.
+    # Owners are missing from the grants of older peers.
+    expiries = {}
+    owners = {}
+    for ip, port, proto, expiry, *owner in grants:
+        if port not in config.OPEN_PORTS or proto not in ('tcp', 'udp'):
+            continue
+        rule = firewall.Rule(firewall.normalize_source(ip), port, proto)
+        expiries[rule] = math.inf if expiry is None else float(expiry)
+        if owner and isinstance(owner[0], str):
+            owners[rule] = owner[0]
+    return expiries, owners
+
+def encode_revokes(expiries):
+    return [[rule.ip, rule.port, rule.proto, None if expiry == math.inf else expiry] for rule, expiry in expiries.items()]
+
+def decode_revokes(revokes):
+    # rule -> expiry of the revoked grants
+    return {firewall.Rule(firewall.normalize_source(ip), port, proto): math.inf if expiry is None else float(expiry)
+            for ip, port, proto, expiry in revokes}
+
+class Replicator:
+    """
+    Sends the local grants to the peers and merges the ones received from them
+    into the grant table.
+    """
+
+    def __init__(self, grant_table):
+        self.grant_table = grant_table
+        # Unique to this run of the daemon, so the ids never repeat
+        self.node = os.urandom(4).hex()
+        self.sequence = itertools.count()
+        self.links = [PeerLink(self, address) for address in config.PEERS]
+        self.seen = collections.OrderedDict()
+        # rule -> (expiry of the revoked grant, time the revocation is forgotten)
+        self.revoked = {}
+        self.lock = threading.Lock()
+
+    def start(self):
+        for link in self.links:
+            link.start()
+        if config.PEER_PORT:
+            threading.Thread(target=self.listen, name='openmed-peers', daemon=True).start()
+
+    def next_id(self):
+        return f"{self.node}-{next(self.sequence)}"
+
+    def publish(self, rules, expiry, owner=None):
+        # Called by the grant table for the local grants
+        grants = encode_grants((rule, expiry, owner) for rule in rules)
+        for link in self.links:
+            link.send(('grants', grants))
+
+    def publish_revoke(self, expiries):
+        # Called by the grant table for the grants revoked locally
+        self.remember_revoked(expiries)
+        revokes = encode_revokes(expiries)
+        for link in self.links:
+            link.send(('revokes', revokes))
+
+    def remember_revoked(self, expiries):
+        now = time.monotonic()
+        with self.lock:
+            for rule, (expiry, forget_at) in list(self.revoked.items()):
+                if forget_at < now:
+                    del self.revoked[rule]
+            for rule, expiry in expiries.items():
+                self.revoked[rule] = (expiry, now + 2 * config.PEER_RESYNC_INTERVAL)
+
+    def receive(self, message, name):
+        # Apply a message from a peer, unless it was already received
+        with self.lock:
+            if message['id'] in self.seen:
+                return
+            self.seen[message['id']] = True
+            if len(self.seen) > SEEN_IDS:
+                self.seen.popitem(last=False)
+        if 'revokes' in message:
+            expiries = decode_revokes(message['revokes'])
+            self.remember_revoked(expiries)
+            revoked = self.grant_table.revoke(expiries, publish=False)
+            if revoked:
+                logger.info(f"openmed: Peer {name} revoked {len(revoked)} grants")
+            return
+        expiries, owners = decode_grants(message['grants'])
+        replicated_grants.inc(len(expiries), direction='received')
+        # Skip the grants revoked here that the peer did not know about yet
+        with self.lock:
+            for rule in [rule for rule in expiries if rule in self.revoked]:
+                if expiries[rule] <= self.revoked[rule][0]:
+                    del expiries[rule]
+        updated = self.grant_table.merge(expiries, owners)
+        if updated and config.DEBUG:
+            print(f"{updated} of {len(expiries)} grants from peer {name} applied")
+
+    def listen(self):
+        # Accept the connections of the peers, one thread each
+        server_socket = protocol.bind_socket(socket.SOCK_STREAM, config.PEER_PORT)
+        server_socket.listen(config.LISTEN_BACKLOG)
+        context = create_context(ssl.Purpose.CLIENT_AUTH)
+        logger.info(f"openmed: Listening for peers on port {config.PEER_PORT}")
+        while True:
+            try:
+                sock, addr = server_socket.accept()
+            except OSError as e:
+                logger.error(f"Error accepting a peer connection: {e}")
+                continue
+            addr = protocol.client_address(addr)
+            threading.Thread(target=self.serve, args=(context, sock, addr), name='openmed-peer', daemon=True).start()
+
+    def serve(self, context, sock, addr):
+        sock.settimeout(config.HANDSHAKE_TIMEOUT)
+        try:
+            with context.wrap_socket(sock, server_side=True) as conn:
+                name = peer_name(conn)
+                if name is None:
+                    logger.error(f"Rejected the peer connection from {addr[0]}: its certificate is not in PEER_NAMES")
+                    return
+                # Peers only send when they have something, and resync periodically
+                conn.settimeout(None)
+                logger.info(f"openmed: Peer {name} connected from {addr[0]}")
+                with conn.makefile('rb') as lines:
+                    for line in lines:
+                        message = json.loads(line)
+                        if message.get('v') != VERSION:
+                            raise ValueError(f"unsupported version {message.get('v')}")
+                        self.receive(message, name)
+        except (OSError, ValueError, KeyError, TypeError) as e:
+            logger.error(f"Error reading from the peer at {addr[0]}: {e}")
+
+class PeerLink:
+    """
+    Connection to one peer. Sends the local grants in batches and all of them
+    on every reconnection and resync. Reconnects with an exponential backoff.
+    """
+
+    def __init__(self, replicator, address):
+        self.replicator = replicator
+        self.host, port = address.rsplit(':', 1)
+        self.host = self.host.strip('[]')
+        self.port = int(port)
+        self.pending = queue.Queue(maxsize=config.PEER_QUEUE_SIZE)
+        # Message being sent when the connection was lost, sent again first
+        self.unsent = None
+        self.thread = threading.Thread(target=self.run, name=f"openmed-peer-{address}", daemon=True)
+
+    def start(self):
+        self.thread.start()
+
+    def send(self, update):
+        # Queue ('grants' or 'revokes', items). Never blocks: grants that do not
+        # fit reach the peer with the next resync, revocations are lost.
+        try:
+            self.pending.put_nowait(update)
+        except queue.Full:
+            if update[0] == 'revokes':
+                logger.error(f"Replication queue of peer {self.host}:{self.port} full, revocations dropped")
+
+    def run(self):
+        context = create_context(ssl.Purpose.SERVER_AUTH)
+        backoff = 1
+        while True:
+            try:
+                with socket.create_connection((self.host, self.port), timeout=config.HANDSHAKE_TIMEOUT) as sock:
+                    sock.setsockopt(socket.SOL_SOCKET, socket.SO_KEEPALIVE, 1)
+                    with context.wrap_socket(sock, server_hostname=self.host) as conn:
+                        if peer_name(conn) is None:
+                            raise ssl.SSLError(f"the certificate of {self.host} is not in PEER_NAMES")
+                        logger.info(f"openmed: Connected to peer {self.host}:{self.port}")
+                        backoff = 1
+                        self.stream(conn)
+            except (OSError, ValueError) as e:
+                delay = random.uniform(backoff / 2, backoff)
+                logger.error(f"Connection to peer {self.host}:{self.port} lost ({e}), reconnecting in {delay:.1f}s")
+                time.sleep(delay)
+                backoff = min(backoff * 2, MAX_BACKOFF)
+
+    def stream(self, conn):
+        if self.unsent is not None:
+            self.write(conn, self.unsent)
+        self.write_items(conn, 'grants', encode_grants(self.replicator.grant_table.snapshot()))
+        next_resync = time.monotonic() + config.PEER_RESYNC_INTERVAL
+        while True:
+            # Wait for the next update, then send the ones of the same kind
+            # queued meanwhile. Updates are sent in order.
+            try:
+                kind, items = self.pending.get(timeout=max(next_resync - time.monotonic(), 0))
+            except queue.Empty:
+                kind, items = 'grants', []
+            while len(items) < BATCH_SIZE and self.pending.queue and self.pending.queue[0][0] == kind:
+                items = items + self.pending.get_nowait()[1]
+            self.write_items(conn, kind, items)
+            if time.monotonic() >= next_resync:
+                self.write_items(conn, 'grants', encode_grants(self.replicator.grant_table.snapshot()))
+                next_resync = time.monotonic() + config.PEER_RESYNC_INTERVAL
+
+    def write_items(self, conn, kind, items):
+        for start in range(0, len(items), BATCH_SIZE):
+            message = {'v': VERSION, 'id': self.replicator.next_id(), kind: items[start:start + BATCH_SIZE]}
+            self.write(conn, message)
+
+    def write(self, conn, message):
+        self.unsent = message
+        conn.sendall(json.dumps(message).encode() + b'\n')
+        self.unsent = None
+        if 'grants' in message:
+            replicated_grants.inc(len(message['grants']), direction='sent')
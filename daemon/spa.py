@@ -0,0 +1,198 @@
+"""
+Single packet authorization (SPA): a knock in one UDP datagram.
+
+Each client has a 256-bit key, shared with the daemon as NAME.spa files (hex)
+in config.SPA_KEYS_DIR. A knock datagram is:
+
+  version (1 byte, 1) | length of NAME (1 byte) | NAME | nonce (12 bytes) | ciphertext
+
+where the ciphertext is AES-256-GCM over timestamp in milliseconds (8 bytes,
+big endian) + command ("OPEN ME" or "OPEN <ip>"), with the version, length and
+NAME as associated data. Knocks older or newer than config.SPA_MAX_CLOCK_SKEW
+are rejected, and so are the nonces already seen within that window, so a
+captured datagram cannot be replayed.
+
+"OPEN ME" opens the ports to the source address of the datagram, which is not
+authenticated: an on-path observer who sends a captured knock from their own
+address before the original arrives gets the grant, and the original is then
+rejected as a replay. With config.SPA_REQUIRE_ADDRESS, knocks must name their
+address in the ciphertext ("OPEN <ip>", e.g. the public address of the client
+with -i) and are rejected, before their nonce is recorded, unless their source
+is within it.
+
+The keys are loaded again on SIGHUP, and when a key file was added, removed or
+written, e.g. by revoke_cert.sh: the listener checks them every
+config.SPA_KEYS_RELOAD_INTERVAL seconds, waking up when no knock comes in.
+"""
+
+import collections
+import glob
+import ipaddress
+import logging
+import os
+import socket
+import struct
+import threading
+import time
+
+from cryptography.exceptions import InvalidTag
+from cryptography.hazmat.primitives.ciphers.aead import AESGCM
+
+import config
+import protocol
+import tlscontext
+
+logger = logging.getLogger('openme_logger')
+
+VERSION = 1
+NONCE_SIZE = 12
+
+def load_keys(keys_dir):
+    # NAME -> AESGCM of every NAME.spa key file
+    keys = {}
+    for path in glob.glob(os.path.join(keys_dir, '*.spa')):
+        name = os.path.basename(path)[:-len('.spa')]
+        with open(path) as key_file:
+            keys[name] = AESGCM(bytes.fromhex(key_file.read().strip()))
+    return keys
+
+def keys_stamp(keys_dir):
+    # Changes whenever a key file is added, removed or written
+    return sorted((path, tlscontext.file_stamp(path)) for path in glob.glob(os.path.join(keys_dir, '*.spa')))
+
+class ReplayCache:
+    """
+    Remembers the nonces seen within the accepted clock skew. They are kept in
+    arrival order, so the expired ones are dropped from the front.
+    """
+
+    def __init__(self, window):
+        self.window = window
+        self.seen = set()
+        self.order = collections.deque()
+
+    def check_and_add(self, nonce, now):
+        # False if the nonce was already seen
+        while self.order and self.order[0][0] < now - 2 * self.window:
+            self.seen.discard(self.order.popleft()[1])
+        if nonce in self.seen:
+            return False
+        self.seen.add(nonce)
+        self.order.append((now, nonce))
+        return True
+
+class SpaError(Exception):
+    pass
+
+class SpaListener:
+    """
+    Receives the knock datagrams and hands the valid ones to `grant`, called
+    with the name of the key, the source address and the command. The keys
+    are the ones in keys_dir.
+    """
+
+    def __init__(self, sock, keys_dir, grant, limiter=None):
+        self.sock = sock
+        self.keys_dir = keys_dir
+        self.keys_stamp = keys_stamp(keys_dir)
+        self.keys = load_keys(keys_dir)
+        self.keys_checked = time.monotonic()
+        self.grant = grant
+        self.limiter = limiter
+        self.replays = ReplayCache(config.SPA_MAX_CLOCK_SKEW)
+        self.thread = threading.Thread(target=self.run, name='openmed-spa', daemon=True)
+
+    def start(self):
+        self.thread.start()
+
+    def reload_keys(self, keys_dir=None):
+        # Load the keys again, from keys_dir if given. Keys that cannot be
+        # loaded keep the current ones
+        keys_dir = keys_dir or self.keys_dir
+        stamp = keys_stamp(keys_dir)
+        try:
+            keys = load_keys(keys_dir)
+        except (OSError, ValueError) as e:
+            logger.error(f"openmed: Could not reload the SPA keys, keeping the current ones: {e}")
+            return False
+        self.keys_dir, self.keys_stamp, self.keys = keys_dir, stamp, keys
+        return True
+
+    def check_keys(self):
+        # Reload the keys if a key file changed, at most every SPA_KEYS_RELOAD_INTERVAL
+        now = time.monotonic()
+        if config.SPA_KEYS_RELOAD_INTERVAL is None or now < self.keys_checked + config.SPA_KEYS_RELOAD_INTERVAL:
+            return
+        self.keys_checked = now
+        if keys_stamp(self.keys_dir) != self.keys_stamp and self.reload_keys():
+            logger.info(f"openmed: Reloaded the SPA keys of {self.keys_dir}")
+
+    def run(self):
+        while True:
+            # Wake up to check the keys even if no knock comes in
+            self.check_keys()
+            self.sock.settimeout(config.SPA_KEYS_RELOAD_INTERVAL)
+            try:
+                datagram, addr = self.sock.recvfrom(2048)
+            except TimeoutError:
+                continue
+            except OSError as e:
+                # E.g. an ICMP error reported on the socket
+                logger.error(f"Error receiving an SPA knock: {e}")
+                continue
+            addr = protocol.client_address(addr)
+            if self.limiter is not None and not self.limiter.allow(addr[0]):
+                continue
+            try:
+                name, command = self.open(datagram, addr[0])
+            except SpaError as e:
+                logger.error(f"Invalid SPA knock from {addr[0]}: {e}")
+                continue
+            try:
+                self.grant(name, addr, command)
+            except Exception:
+                logger.exception(f"Error handling the SPA knock of {name} from {addr[0]}")
+
+    def open(self, datagram, source):
+        # Authenticate and decrypt a datagram sent from source. Returns the key
+        # name and the command.
+        if len(datagram) < 2 or datagram[0] != VERSION:
+            raise SpaError("unknown version")
+        header_size = 2 + datagram[1]
+        name = datagram[2:header_size].decode(errors='replace')
+        key = self.keys.get(name)
+        if key is None:
+            raise SpaError(f"unknown key {name}")
+        nonce = datagram[header_size:header_size + NONCE_SIZE]
+        try:
+            plaintext = key.decrypt(nonce, datagram[header_size + NONCE_SIZE:], datagram[:header_size])
+        except (InvalidTag, ValueError):
+            raise SpaError(f"authentication failed for key {name}")
+
+        # Only authenticated datagrams get here, so they cannot fill the replay cache
+        if len(plaintext) < 8:
+            raise SpaError(f"truncated knock for key {name}")
+        now = time.time()
+        timestamp, = struct.unpack('>Q', plaintext[:8])
+        if abs(now - timestamp / 1000) > config.SPA_MAX_CLOCK_SKEW:
+            raise SpaError(f"timestamp out of the accepted window for key {name}")
+        command = plaintext[8:].decode(errors='replace').strip()
+        # Before recording the nonce, so a copy from elsewhere does not void the original
+        if config.SPA_REQUIRE_ADDRESS and not sent_from(command, source):
+            raise SpaError(f"knock for key {name} not for its source address")
+        if not self.replays.check_and_add((name, nonce), now):
+            raise SpaError(f"replayed knock for key {name}")
+        return name, command
+
+def sent_from(command, source):
+    # True if the command opens the ports to an address or network with source in it
+    if not command.startswith('OPEN ') or command == 'OPEN ME':
+        return False
+    try:
+        return ipaddress.ip_address(source) in ipaddress.ip_network(command[5:].strip(), strict=False)
+    except ValueError:
+        return False
+
+def create_socket():
+    # Dual-stack when LISTEN_ADDRESS is an IPv6 address
+    return protocol.bind_socket(socket.SOCK_DGRAM, config.SPA_PORT)
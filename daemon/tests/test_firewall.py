@@ -0,0 +1,115 @@
+"""
+Tests of the iptables backends of firewall.py, against canned iptables output.
+"""
+
+import unittest
+from unittest import mock
+
+import config
+import firewall
+
+Rule = firewall.Rule
+
+CHAIN = """-N OPENME
+-A OPENME -s 10.0.0.1/32 -p tcp -m tcp --dport 80 -m comment --comment openme -j ACCEPT
+-A OPENME -s 10.0.0.1/32 -p tcp -m tcp --dport 80 -m comment --comment "openme" -j ACCEPT
+-A OPENME -s 10.0.0.2/32 -p udp -m udp --dport 443 -m comment --comment openme -j ACCEPT
+-A OPENME -s 10.0.0.3/32 -p tcp -m tcp --dport 80 -m comment --comment "added by hand" -j ACCEPT
+-A OPENME -s 10.0.0.4/32 -p tcp -m tcp --dport 22 -m comment --comment openme -j ACCEPT
+-A OPENME -s 10.0.0.5/32 -p tcp -m tcp --dport 80 -m comment --comment openme -j DROP
+"""
+
+INPUT = """-P INPUT ACCEPT
+-A INPUT -j OPENME
+-A INPUT -s 10.1.0.1/32 -p tcp -m tcp --dport 80 -j ACCEPT
+-A INPUT -s 10.1.0.2/32 -p tcp -m tcp --dport 443 -j ACCEPT
+-A INPUT -s 10.1.0.0/24 -p tcp -m tcp --dport 80 -m comment --comment office -j ACCEPT
+"""
+
+class FakeBackend(firewall.IptablesRestoreBackend):
+    # Answers iptables -S with the canned output, and records the scripts run
+
+    def __init__(self, listings):
+        super().__init__()
+        self.listings = listings
+        self.scripts = []
+
+    def run(self, args, script=None, check=True):
+        if script is not None:
+            self.scripts.append((args[0], script.splitlines()[1:-1]))
+            return ''
+        if args[1] == '-S':
+            return self.listings.get((args[0], args[2]), None if not check else '')
+        return ''
+
+class IptablesBackendTest(unittest.TestCase):
+
+    def setUp(self):
+        patcher = mock.patch.multiple(config, DEBUG=False, OPEN_PORTS=[80, 443], IPTABLES_CHAIN='OPENME')
+        patcher.start()
+        self.addCleanup(patcher.stop)
+
+    def test_list_chain_rules(self):
+        backend = FakeBackend({('iptables', 'OPENME'): CHAIN})
+        self.assertEqual(backend.list_chain_rules('iptables'),
+                         [Rule('10.0.0.1', 80, 'tcp'), Rule('10.0.0.1', 80, 'tcp'), Rule('10.0.0.2', 443, 'udp')])
+
+    def test_list_rules_without_duplicates(self):
+        backend = FakeBackend({('iptables', 'OPENME'): CHAIN})
+        self.assertEqual(backend.list_rules(), [Rule('10.0.0.1', 80, 'tcp'), Rule('10.0.0.2', 443, 'udp')])
+
+    def test_list_uncommented_rules(self):
+        backend = FakeBackend({('iptables', 'INPUT'): INPUT})
+        self.assertEqual(backend.list_chain_rules('iptables', 'INPUT', comment=None),
+                         [Rule('10.1.0.1', 80, 'tcp'), Rule('10.1.0.2', 443, 'tcp')])
+
+    def test_migrate_only_the_journaled_rules(self):
+        backend = FakeBackend({('iptables', 'INPUT'): INPUT})
+        backend.migrate({Rule('10.1.0.1', 80, 'tcp'), Rule('10.9.9.9', 80, 'tcp')})
+        self.assertEqual(backend.scripts, [('iptables-restore', [
+            '-D INPUT -p tcp -s 10.1.0.1 --dport 80 -j ACCEPT',
+            '-A OPENME -p tcp -s 10.1.0.1 --dport 80 -m comment --comment openme -j ACCEPT',
+        ])])
+
+    def test_setup_does_not_migrate(self):
+        backend = FakeBackend({('iptables', 'INPUT'): INPUT, ('iptables', 'OPENME'): CHAIN})
+        backend.setup()
+        self.assertEqual(backend.scripts, [])
+
+    def test_collect_the_duplicates_at_once(self):
+        backend = FakeBackend({('iptables', 'OPENME'): CHAIN})
+        active = {Rule('10.0.0.1', 80, 'tcp'), Rule('10.0.0.2', 443, 'udp')}
+        self.assertEqual(backend.collect_garbage(active, set()), set())
+        self.assertEqual(backend.scripts, [('iptables-restore', [
+            '-D OPENME -p tcp -s 10.0.0.1 --dport 80 -m comment --comment openme -j ACCEPT',
+        ])])
+
+    def test_collect_the_rules_not_granted_on_the_second_pass(self):
+        backend = FakeBackend({('iptables', 'OPENME'): CHAIN})
+        active = {Rule('10.0.0.1', 80, 'tcp')}
+        suspects = backend.collect_garbage(active, set())
+        self.assertEqual(suspects, {Rule('10.0.0.2', 443, 'udp')})
+        backend.scripts = []
+        self.assertEqual(backend.collect_garbage(active, suspects), set())
+        self.assertIn('-D OPENME -p udp -s 10.0.0.2 --dport 443 -m comment --comment openme -j ACCEPT',
+                      backend.scripts[0][1])
+
+    def test_never_collect_untagged_rules(self):
+        # The rule commented "added by hand" is never a suspect
+        backend = FakeBackend({('iptables', 'OPENME'): CHAIN, ('iptables', 'INPUT'): INPUT})
+        suspects = backend.collect_garbage(set(), set())
+        suspects = backend.collect_garbage(set(), suspects)
+        removed = [line for _, script in backend.scripts for line in script]
+        self.assertFalse([line for line in removed if '10.0.0.3' in line or '10.1.0.' in line])
+
+    def test_restore_script(self):
+        backend = FakeBackend({})
+        backend.apply([Rule('10.0.0.1', 80, 'tcp'), Rule('2001:db8::1', 80, 'tcp')], [Rule('10.0.0.2', 80, 'udp')])
+        self.assertEqual(sorted(backend.scripts), [
+            ('ip6tables-restore', ['-A OPENME -p tcp -s 2001:db8::1 --dport 80 -m comment --comment openme -j ACCEPT']),
+            ('iptables-restore', ['-A OPENME -p tcp -s 10.0.0.1 --dport 80 -m comment --comment openme -j ACCEPT',
+                                  '-D OPENME -p udp -s 10.0.0.2 --dport 80 -m comment --comment openme -j ACCEPT']),
+        ])
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,147 @@
+"""
+Tests of grants.GrantTable, with a committer that records the updates instead
+of applying them. Run from the daemon directory: python3 -m unittest discover tests
+"""
+
+import math
+import threading
+import time
+import unittest
+from concurrent.futures import Future
+from unittest import mock
+
+import config
+import firewall
+import grants
+
+class RecordingCommitter:
+    # Commits every update at once, and keeps the rules it would have applied
+
+    def __init__(self):
+        self.rules = set()
+
+    def submit(self, add=(), remove=()):
+        self.rules.update(add)
+        self.rules.difference_update(remove)
+        future = Future()
+        future.set_result(None)
+        return future
+
+class SlowRemovalCommitter(RecordingCommitter):
+    # Takes a while to queue the removals, like a thread preempted right before
+
+    def submit(self, add=(), remove=()):
+        if remove:
+            time.sleep(0.1)
+        return super().submit(add, remove)
+
+RULE = firewall.Rule('10.0.0.1', 80, 'tcp')
+OTHER_RULE = firewall.Rule('10.0.0.2', 80, 'tcp')
+
+class GrantTableTest(unittest.TestCase):
+
+    def setUp(self):
+        self.committer = RecordingCommitter()
+        self.table = grants.GrantTable(self.committer)
+
+    def test_grant_adds_the_rules_once(self):
+        first = self.table.grant([RULE], ttl=60, owner='client1')
+        second = self.table.grant([RULE], ttl=120)
+        self.assertGreater(second, first)
+        self.assertEqual(self.committer.rules, {RULE})
+        self.assertEqual(self.table.snapshot(), [(RULE, second, 'client1')])
+
+    def test_grant_without_ttl_never_expires(self):
+        with mock.patch.object(config, 'GRANT_TTL', None):
+            self.assertEqual(self.table.grant([RULE]), math.inf)
+
+    def test_revoke_removes_the_rules(self):
+        expiry = self.table.grant([RULE, OTHER_RULE], ttl=60)
+        self.assertEqual(self.table.revoke({RULE: expiry}), [RULE])
+        self.assertEqual(self.committer.rules, {OTHER_RULE})
+        self.assertEqual(self.table.active_rules(), {OTHER_RULE})
+
+    def test_revoke_keeps_the_rules_granted_again(self):
+        expiry = self.table.grant([RULE], ttl=60)
+        self.table.grant([RULE], ttl=120)
+        self.assertEqual(self.table.revoke({RULE: expiry}), [])
+        self.assertEqual(self.committer.rules, {RULE})
+
+    def test_revoke_a_missing_rule_with_infinite_expiry(self):
+        # E.g. a revocation from a peer for a rule never granted here
+        self.assertEqual(self.table.revoke({RULE: math.inf}), [])
+        self.assertEqual(self.table.snapshot(), [])
+
+    def test_revoke_twice(self):
+        with mock.patch.object(config, 'GRANT_TTL', None):
+            self.table.grant([RULE])
+        self.assertEqual(self.table.revoke({RULE: math.inf}), [RULE])
+        self.assertEqual(self.table.revoke({RULE: math.inf}), [])
+
+    def test_merge_keeps_the_longest_grant(self):
+        expiry = self.table.grant([RULE], ttl=120)
+        self.assertEqual(self.table.merge({RULE: expiry - 60, OTHER_RULE: expiry}, {OTHER_RULE: 'peer'}), 1)
+        self.assertEqual(sorted(self.table.snapshot()), [(RULE, expiry, None), (OTHER_RULE, expiry, 'peer')])
+
+    def test_merge_skips_the_expired_grants(self):
+        self.assertEqual(self.table.merge({RULE: time.time() - 1}, {}), 0)
+        self.assertEqual(self.committer.rules, set())
+
+    def test_expired_grants_are_removed(self):
+        with mock.patch.object(config, 'GRANT_EXPIRY_RESOLUTION', 0):
+            self.table.start()
+            self.table.grant([RULE], ttl=0.05)
+            self.table.grant([OTHER_RULE], ttl=60)
+            deadline = time.monotonic() + 5
+            while RULE in self.committer.rules and time.monotonic() < deadline:
+                time.sleep(0.01)
+        self.assertEqual(self.committer.rules, {OTHER_RULE})
+        self.assertEqual(self.table.active_rules(), {OTHER_RULE})
+
+    def test_refresh_postpones_the_expiry(self):
+        with mock.patch.object(config, 'GRANT_EXPIRY_RESOLUTION', 0):
+            self.table.start()
+            self.table.grant([RULE], ttl=0.05)
+            self.table.grant([RULE], ttl=60)
+            time.sleep(0.2)
+        self.assertEqual(self.committer.rules, {RULE})
+
+    def wait_until_forgotten(self, rule):
+        deadline = time.monotonic() + 5
+        while rule in self.table.active_rules() and time.monotonic() < deadline:
+            time.sleep(0.001)
+
+    def test_grant_again_while_expiring(self):
+        # The removal of the expired grant must not undo the new one
+        self.committer = SlowRemovalCommitter()
+        self.table = grants.GrantTable(self.committer)
+        with mock.patch.object(config, 'GRANT_EXPIRY_RESOLUTION', 0):
+            self.table.start()
+            self.table.grant([RULE], ttl=0.05)
+            self.wait_until_forgotten(RULE)
+            self.table.grant([RULE], ttl=60)
+            time.sleep(0.2)
+        self.assertEqual(self.table.active_rules(), {RULE})
+        self.assertEqual(self.committer.rules, {RULE})
+
+    def test_grant_again_while_revoking(self):
+        self.committer = SlowRemovalCommitter()
+        self.table = grants.GrantTable(self.committer)
+        expiry = self.table.grant([RULE], ttl=60)
+        revoking = threading.Thread(target=self.table.revoke, args=({RULE: expiry},))
+        revoking.start()
+        self.wait_until_forgotten(RULE)
+        self.table.grant([RULE], ttl=120)
+        revoking.join()
+        self.assertEqual(self.table.active_rules(), {RULE})
+        self.assertEqual(self.committer.rules, {RULE})
+
+    def test_failed_additions_are_forgotten(self):
+        future = Future()
+        future.set_exception(RuntimeError('iptables failed'))
+        self.committer.submit = lambda add=(), remove=(): future
+        self.table.grant([RULE], ttl=60, wait=False)
+        self.assertEqual(self.table.snapshot(), [])
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,45 @@
+"""
+Tests of the SQLite grant journal of journal.py.
+"""
+
+import math
+import os
+import tempfile
+import unittest
+
+import firewall
+import journal
+
+RULE = firewall.Rule('10.0.0.1', 80, 'tcp')
+OTHER_RULE = firewall.Rule('2001:db8::1', 443, 'udp')
+
+class GrantJournalTest(unittest.TestCase):
+
+    def setUp(self):
+        workdir = tempfile.TemporaryDirectory()
+        self.addCleanup(workdir.cleanup)
+        self.journal = journal.GrantJournal(os.path.join(workdir.name, 'grants.db'))
+        self.addCleanup(self.journal.db.close)
+
+    def test_put_and_load(self):
+        self.journal.write([('put', [RULE, OTHER_RULE], (1000.0, 'client1'))])
+        self.assertEqual(self.journal.load(), ({RULE: 1000.0, OTHER_RULE: 1000.0},
+                                               {RULE: 'client1', OTHER_RULE: 'client1'}))
+
+    def test_grants_without_expiry(self):
+        self.journal.write([('put', [RULE], (None, None))])
+        self.assertEqual(self.journal.load(), ({RULE: math.inf}, {}))
+
+    def test_put_again_keeps_the_owner(self):
+        self.journal.write([('put', [RULE], (1000.0, 'client1')), ('put', [RULE], (2000.0, None))])
+        self.assertEqual(self.journal.load(), ({RULE: 2000.0}, {RULE: 'client1'}))
+        self.journal.write([('put', [RULE], (3000.0, 'client2'))])
+        self.assertEqual(self.journal.load(), ({RULE: 3000.0}, {RULE: 'client2'}))
+
+    def test_updates_apply_in_order(self):
+        self.journal.write([('put', [RULE, OTHER_RULE], (1000.0, None)), ('delete', [RULE], None),
+                            ('put', [OTHER_RULE], (2000.0, None))])
+        self.assertEqual(self.journal.load(), ({OTHER_RULE: 2000.0}, {}))
+
+if __name__ == '__main__':
+    unittest.main()
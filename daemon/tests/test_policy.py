@@ -0,0 +1,88 @@
+"""
+Tests of the per-certificate policies of policy.py.
+"""
+
+import unittest
+
+import policy
+
+OPEN_PORTS = [22, 80, 443]
+
+def subject(**attributes):
+    # A certificate subject as returned by getpeercert()
+    return tuple(((key, value),) for key, value in attributes.items())
+
+class CompilePolicyTest(unittest.TestCase):
+
+    def test_missing_keys_allow_everything(self):
+        self.assertEqual(policy.compile_policy('CN=a', {}, OPEN_PORTS),
+                         policy.Policy((22, 80, 443), ('tcp', 'udp'), None, True))
+
+    def test_policy(self):
+        spec = {'ports': [80], 'protos': ['tcp'], 'ttl': 60, 'third_party': False}
+        self.assertEqual(policy.compile_policy('CN=a', spec, OPEN_PORTS), policy.Policy((80,), ('tcp',), 60, False))
+
+    def test_invalid_policies(self):
+        for spec in ([], {'port': [80]}, {'ports': [8080]}, {'protos': ['icmp']}, {'ttl': -1}, {'ttl': '60'}):
+            with self.assertRaises(ValueError):
+                policy.compile_policy('CN=a', spec, OPEN_PORTS)
+
+    def test_third_party_must_be_a_bool(self):
+        for third_party in ('false', 'no', 0, 1, None):
+            with self.assertRaisesRegex(ValueError, 'third_party'):
+                policy.compile_policy('CN=a', {'third_party': third_party}, OPEN_PORTS)
+        self.assertFalse(policy.compile_policy('CN=a', {'third_party': False}, OPEN_PORTS).third_party)
+
+    def test_ttl_must_be_positive(self):
+        # ttl 0 would be a grant that never expires
+        for ttl in (0, 0.0, -5, True, float('nan')):
+            with self.assertRaisesRegex(ValueError, 'ttl'):
+                policy.compile_policy('CN=a', {'ttl': ttl}, OPEN_PORTS)
+        self.assertEqual(policy.compile_policy('CN=a', {'ttl': 0.5}, OPEN_PORTS).ttl, 0.5)
+
+class PolicyTableTest(unittest.TestCase):
+
+    def setUp(self):
+        self.table = policy.PolicyTable({
+            'OU=ops': {'ports': [22, 80]},
+            'CN=alice': {'ports': [443], 'third_party': False},
+        }, {'ports': [80], 'protos': ['tcp']}, OPEN_PORTS)
+
+    def test_common_name_wins_over_unit(self):
+        self.assertEqual(self.table.lookup(subject(organizationalUnitName='ops', commonName='alice')).ports, (443,))
+        self.assertEqual(self.table.lookup(subject(commonName='alice', organizationalUnitName='ops')).ports, (443,))
+
+    def test_unit(self):
+        self.assertEqual(self.table.lookup(subject(commonName='bob', organizationalUnitName='ops')).ports, (22, 80))
+
+    def test_default_policy(self):
+        self.assertEqual(self.table.lookup(subject(commonName='carol')), policy.Policy((80,), ('tcp',), None, True))
+        self.assertEqual(self.table.lookup(()).ports, (80,))
+
+    def test_no_default_policy(self):
+        table = policy.PolicyTable({'CN=alice': {}}, None, OPEN_PORTS)
+        self.assertIsNone(table.lookup(subject(commonName='carol')))
+        self.assertIsNotNone(table.lookup(subject(commonName='alice')))
+
+    def test_lookup_name(self):
+        self.assertEqual(self.table.lookup_name('alice').ports, (443,))
+        self.assertEqual(self.table.lookup_name('carol').ports, (80,))
+
+    def test_lookups_are_remembered(self):
+        alice = subject(commonName='alice')
+        first = self.table.lookup(alice)
+        self.assertIs(self.table.by_subject[alice], first)
+        self.table.policies.clear()
+        self.assertIs(self.table.lookup(alice), first)
+
+    def test_invalid_keys(self):
+        for key in ('alice', 'CN=', 'O=acme', 'cn=alice'):
+            with self.assertRaises(ValueError):
+                policy.PolicyTable({key: {}}, None, OPEN_PORTS)
+
+    def test_invalid_default_policy(self):
+        with self.assertRaises(ValueError):
+            policy.PolicyTable({}, {'ports': [8080]}, OPEN_PORTS)
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,177 @@
+"""
+Tests of the validation of the JSON requests of protocol.py.
+"""
+
+import errno
+import json
+import socket
+import unittest
+from unittest import mock
+
+import config
+import firewall
+import policy
+import protocol
+
+Rule = firewall.Rule
+
+POLICY = policy.Policy(ports=(80, 443), protos=('tcp', 'udp'), ttl=None, third_party=True)
+OWN_ADDRESS_ONLY = POLICY._replace(third_party=False)
+
+class FakeConn:
+    # Hands out the chunks one recv() at a time, then b'' as a closed connection
+
+    def __init__(self, *chunks):
+        self.chunks = list(chunks)
+
+    def recv(self, size):
+        return self.chunks.pop(0) if self.chunks else b''
+
+class RequestTest(unittest.TestCase):
+
+    def setUp(self):
+        patcher = mock.patch.multiple(config, BULK_MAX_RULES=100, BULK_MIN_PREFIXLEN=16,
+                                      BULK_MIN_PREFIXLEN6=48, MAX_REQUEST_SIZE=1024)
+        patcher.start()
+        self.addCleanup(patcher.stop)
+
+    def assertRejected(self, code, function, *args):
+        with self.assertRaises(protocol.ProtocolError) as raised:
+            function(*args)
+        self.assertEqual(raised.exception.code, code)
+
+    def test_parse_request(self):
+        self.assertEqual(protocol.parse_request('{"v": 1, "op": "open"}'), {'v': 1, 'op': 'open'})
+        self.assertRejected(protocol.BAD_REQUEST, protocol.parse_request, '{"v": 1')
+        self.assertRejected(protocol.BAD_REQUEST, protocol.parse_request, '[1]')
+        self.assertRejected(protocol.UNSUPPORTED_VERSION, protocol.parse_request, '{"v": 2}')
+        self.assertRejected(protocol.UNSUPPORTED_VERSION, protocol.parse_request, '{"op": "open"}')
+
+    def test_parse_request_id(self):
+        self.assertEqual(protocol.parse_request_id({'id': 'a'}), 'a')
+        self.assertEqual(protocol.parse_request_id({'id': 7}), 7)
+        self.assertIsNone(protocol.parse_request_id({}))
+        for request_id in (True, 1.5, ['a'], {}):
+            self.assertRejected(protocol.BAD_REQUEST, protocol.parse_request_id, {'id': request_id})
+
+    def test_parse_target(self):
+        self.assertEqual(protocol.parse_target('10.0.0.5'), '10.0.0.5')
+        self.assertEqual(protocol.parse_target('10.0.0.5/32'), '10.0.0.5')
+        self.assertEqual(protocol.parse_target('10.1.2.3/24'), '10.1.2.0/24')
+        self.assertEqual(protocol.parse_target('2001:DB8::1'), '2001:db8::1')
+        self.assertEqual(protocol.parse_target('::ffff:10.0.0.5'), '10.0.0.5')
+        for target in ('10.0.0', '010.0.0.5', '10.0.0.5 ', '10.0.0.5/33', 'localhost', '', 5, None):
+            self.assertRejected(protocol.BAD_REQUEST, protocol.parse_target, target)
+
+    def test_parse_target_prefix_limits(self):
+        self.assertEqual(protocol.parse_target('10.0.0.0/16'), '10.0.0.0/16')
+        self.assertRejected(protocol.FORBIDDEN, protocol.parse_target, '10.0.0.0/15')
+        self.assertRejected(protocol.FORBIDDEN, protocol.parse_target, '0.0.0.0/0')
+        self.assertEqual(protocol.parse_target('2001:db8::/48'), '2001:db8::/48')
+        self.assertRejected(protocol.FORBIDDEN, protocol.parse_target, '2001:db8::/47')
+
+    def test_parse_ports(self):
+        allowed = {80, 443, 8000, 8001, 8002}
+        self.assertEqual(protocol.parse_ports([80, '443', '8000-8002'], allowed), [80, 443, 8000, 8001, 8002])
+        self.assertRejected(protocol.FORBIDDEN, protocol.parse_ports, [22], allowed)
+        self.assertRejected(protocol.FORBIDDEN, protocol.parse_ports, ['8000-8003'], allowed)
+        for port in ('http', None, [80], '8002-8000', '1-2-3', '0-70000', '-80', '80-', ''):
+            self.assertRejected(protocol.BAD_REQUEST, protocol.parse_ports, [port], allowed)
+
+    def test_parse_ports_strict_types(self):
+        # Only integers and strings of digits, nothing int() would round or coerce
+        allowed = set(range(1, 65536))
+        for port in (1.9, 22.0, True, False, '22.0', ' 80', '80 ', '+80', '\u0668\u0660', '0x50', 0, -1, 65536, 70000):
+            self.assertRejected(protocol.BAD_REQUEST, protocol.parse_ports, [port], allowed)
+        for port in ('1.9-3', '1-2.0', 'true-2'):
+            self.assertRejected(protocol.BAD_REQUEST, protocol.parse_ports, [port], allowed)
+        self.assertEqual(protocol.parse_ports([1, '65535', '1-2'], allowed), [1, 65535, 1, 2])
+
+    def test_open_request_defaults(self):
+        rules = protocol.parse_open_request({}, '10.0.0.5', POLICY)
+        self.assertEqual(rules, [Rule('10.0.0.5', 80, 'tcp'), Rule('10.0.0.5', 80, 'udp'),
+                                 Rule('10.0.0.5', 443, 'tcp'), Rule('10.0.0.5', 443, 'udp')])
+
+    def test_open_request_without_duplicates(self):
+        request = {'targets': ['10.0.0.5', '10.0.0.5/32'], 'ports': [80, 80], 'protos': ['tcp']}
+        self.assertEqual(protocol.parse_open_request(request, '10.0.0.5', POLICY), [Rule('10.0.0.5', 80, 'tcp')])
+
+    def test_open_request_validation(self):
+        for request in ({'targets': []}, {'targets': '10.0.0.5'}, {'ports': 80}, {'protos': 'tcp'},
+                        {'protos': ['icmp']}, {'targets': ['nowhere']}):
+            self.assertRejected(protocol.BAD_REQUEST, protocol.parse_open_request, request, '10.0.0.5', POLICY)
+
+    def test_open_request_policy(self):
+        tcp_only = POLICY._replace(ports=(80,), protos=('tcp',))
+        self.assertRejected(protocol.FORBIDDEN, protocol.parse_open_request, {'protos': ['udp']}, '10.0.0.5', tcp_only)
+        self.assertRejected(protocol.FORBIDDEN, protocol.parse_open_request, {'ports': [443]}, '10.0.0.5', tcp_only)
+        self.assertEqual(protocol.parse_open_request({}, '10.0.0.5', tcp_only), [Rule('10.0.0.5', 80, 'tcp')])
+
+    def test_open_request_third_party(self):
+        request = {'targets': ['10.0.0.6']}
+        self.assertEqual(len(protocol.parse_open_request(request, '10.0.0.5', POLICY)), 4)
+        self.assertRejected(protocol.FORBIDDEN, protocol.parse_open_request, request, '10.0.0.5', OWN_ADDRESS_ONLY)
+        self.assertEqual(len(protocol.parse_open_request({'targets': ['10.0.0.5/32']}, '10.0.0.5', OWN_ADDRESS_ONLY)), 4)
+
+    def test_open_request_too_many_rules(self):
+        request = {'targets': ['10.0.0.0/24'] + [f'10.0.1.{i}' for i in range(25)]}
+        self.assertRejected(protocol.TOO_LARGE, protocol.parse_open_request, request, '10.0.0.5', POLICY)
+
+    def test_wants_keepalive(self):
+        self.assertTrue(protocol.wants_keepalive({'keepalive': True}))
+        self.assertFalse(protocol.wants_keepalive({}))
+        self.assertRejected(protocol.BAD_REQUEST, protocol.wants_keepalive, {'keepalive': 1})
+
+    def test_client_address(self):
+        self.assertEqual(protocol.client_address(('::ffff:10.0.0.5', 1234, 0, 0)), ('10.0.0.5', 1234, 0, 0))
+        self.assertEqual(protocol.client_address(('2001:db8::1', 1234, 0, 0)), ('2001:db8::1', 1234, 0, 0))
+        self.assertEqual(protocol.client_address(('10.0.0.5', 1234)), ('10.0.0.5', 1234))
+
+class LineReaderTest(unittest.TestCase):
+
+    def setUp(self):
+        patcher = mock.patch.object(config, 'MAX_REQUEST_SIZE', 16)
+        patcher.start()
+        self.addCleanup(patcher.stop)
+
+    def test_pipelined_lines(self):
+        reader = protocol.LineReader(FakeConn(b'{"v": 1}\n{"v"', b': 1}\nOPEN'), b'')
+        self.assertEqual(reader.read_line(), b'{"v": 1}')
+        self.assertTrue(reader.buffered())
+        self.assertEqual(reader.read_line(), b'{"v": 1}')
+        self.assertEqual(reader.read_line(), b'OPEN')
+        self.assertIsNone(reader.read_line())
+
+    def test_request_too_large(self):
+        reader = protocol.LineReader(FakeConn(b'x' * 10, b'x' * 10))
+        with self.assertRaises(protocol.ProtocolError) as raised:
+            reader.read_line()
+        self.assertEqual(raised.exception.code, protocol.TOO_LARGE)
+        reader = protocol.LineReader(FakeConn(b'x' * 20 + b'\n'))
+        self.assertRaises(protocol.ProtocolError, reader.read_line)
+
+class ReplyTest(unittest.TestCase):
+
+    def test_replies(self):
+        conn = mock.Mock()
+        protocol.send_reply(conn, protocol.ok_reply([Rule('10.0.0.5', 80, 'tcp')], float('inf')), 'a')
+        reply = json.loads(conn.sendall.call_args[0][0])
+        self.assertEqual(reply, {'v': 1, 'status': 'ok', 'code': 200, 'rules': 1, 'expires': None, 'id': 'a'})
+
+class ListenAddressTest(unittest.TestCase):
+
+    def test_ipv4_fallback(self):
+        def no_ipv6(family=socket.AF_INET, *args):
+            raise OSError(errno.EAFNOSUPPORT, "Address family not supported by protocol")
+        with mock.patch.object(config, 'LISTEN_ADDRESS', '::'), mock.patch.object(socket, 'socket', no_ipv6):
+            with self.assertLogs('openme_logger', 'WARNING'):
+                self.assertEqual(protocol.listen_address(), (socket.AF_INET, '0.0.0.0'))
+        with mock.patch.object(config, 'LISTEN_ADDRESS', '2001:db8::1'), mock.patch.object(socket, 'socket', no_ipv6):
+            self.assertRaises(OSError, protocol.listen_address)
+
+    def test_ipv4_address(self):
+        with mock.patch.object(config, 'LISTEN_ADDRESS', '127.0.0.1'):
+            self.assertEqual(protocol.listen_address(), (socket.AF_INET, '127.0.0.1'))
+
+if __name__ == '__main__':
+    unittest.main()
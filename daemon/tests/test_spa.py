@@ -0,0 +1,148 @@
+"""
+Tests of the SPA datagrams of spa.py: authentication, clock skew, replays and
+source addresses.
+"""
+
+import os
+import socket
+import struct
+import tempfile
+import time
+import unittest
+from unittest import mock
+
+from cryptography.hazmat.primitives.ciphers.aead import AESGCM
+
+import config
+import spa
+
+KEY = bytes(range(32))
+
+def datagram(command, name='client1', key=KEY, timestamp=None, nonce=None):
+    # A knock as the clients build it
+    header = bytes([spa.VERSION, len(name)]) + name.encode()
+    nonce = nonce or os.urandom(spa.NONCE_SIZE)
+    timestamp = time.time() if timestamp is None else timestamp
+    plaintext = struct.pack('>Q', int(timestamp * 1000)) + command.encode()
+    return header + nonce + AESGCM(key).encrypt(nonce, plaintext, header)
+
+def write_key(keys_dir, name, key=KEY):
+    with open(os.path.join(keys_dir, name + '.spa'), 'w') as key_file:
+        key_file.write(key.hex() + '\n')
+
+class SpaListenerTest(unittest.TestCase):
+
+    def setUp(self):
+        patcher = mock.patch.multiple(config, SPA_MAX_CLOCK_SKEW=30, SPA_REQUIRE_ADDRESS=False,
+                                      SPA_KEYS_RELOAD_INTERVAL=0)
+        patcher.start()
+        self.addCleanup(patcher.stop)
+        keys_dir = tempfile.TemporaryDirectory()
+        self.addCleanup(keys_dir.cleanup)
+        self.keys_dir = keys_dir.name
+        write_key(self.keys_dir, 'client1')
+        self.listener = spa.SpaListener(None, self.keys_dir, None)
+
+    def test_valid_knock(self):
+        self.assertEqual(self.listener.open(datagram('OPEN ME'), '192.0.2.1'), ('client1', 'OPEN ME'))
+
+    def test_replayed_knock(self):
+        knock = datagram('OPEN ME')
+        self.listener.open(knock, '192.0.2.1')
+        with self.assertRaisesRegex(spa.SpaError, 'replayed'):
+            self.listener.open(knock, '192.0.2.1')
+
+    def test_same_nonce_for_another_key(self):
+        self.listener.keys['client2'] = AESGCM(KEY)
+        nonce = os.urandom(spa.NONCE_SIZE)
+        self.listener.open(datagram('OPEN ME', nonce=nonce), '192.0.2.1')
+        self.assertEqual(self.listener.open(datagram('OPEN ME', 'client2', nonce=nonce), '192.0.2.1')[0], 'client2')
+
+    def test_clock_skew(self):
+        for timestamp in (time.time() - 31, time.time() + 31):
+            with self.assertRaisesRegex(spa.SpaError, 'window'):
+                self.listener.open(datagram('OPEN ME', timestamp=timestamp), '192.0.2.1')
+        self.listener.open(datagram('OPEN ME', timestamp=time.time() - 29), '192.0.2.1')
+
+    def test_unknown_key(self):
+        with self.assertRaisesRegex(spa.SpaError, 'unknown key'):
+            self.listener.open(datagram('OPEN ME', 'client9'), '192.0.2.1')
+
+    def test_wrong_key(self):
+        with self.assertRaisesRegex(spa.SpaError, 'authentication'):
+            self.listener.open(datagram('OPEN ME', key=bytes(32)), '192.0.2.1')
+
+    def test_tampered_header(self):
+        knock = bytearray(datagram('OPEN ME'))
+        knock[-1] ^= 1
+        with self.assertRaisesRegex(spa.SpaError, 'authentication'):
+            self.listener.open(bytes(knock), '192.0.2.1')
+
+    def test_unknown_version(self):
+        with self.assertRaisesRegex(spa.SpaError, 'version'):
+            self.listener.open(b'\x02' + datagram('OPEN ME')[1:], '192.0.2.1')
+
+    def test_truncated(self):
+        with self.assertRaises(spa.SpaError):
+            self.listener.open(b'\x01', '192.0.2.1')
+
+    def test_required_address(self):
+        config.SPA_REQUIRE_ADDRESS = True
+        with self.assertRaisesRegex(spa.SpaError, 'source'):
+            self.listener.open(datagram('OPEN ME'), '192.0.2.1')
+        self.assertEqual(self.listener.open(datagram('OPEN 192.0.2.1'), '192.0.2.1')[1], 'OPEN 192.0.2.1')
+        self.assertEqual(self.listener.open(datagram('OPEN 2001:db8::/64'), '2001:db8::5')[1], 'OPEN 2001:db8::/64')
+
+    def test_copy_from_elsewhere_does_not_void_the_original(self):
+        config.SPA_REQUIRE_ADDRESS = True
+        knock = datagram('OPEN 192.0.2.1')
+        with self.assertRaisesRegex(spa.SpaError, 'source'):
+            self.listener.open(knock, '198.51.100.9')
+        self.assertEqual(self.listener.open(knock, '192.0.2.1')[0], 'client1')
+
+    def test_removed_keys_are_dropped(self):
+        os.unlink(os.path.join(self.keys_dir, 'client1.spa'))
+        write_key(self.keys_dir, 'client2')
+        self.listener.check_keys()
+        with self.assertRaisesRegex(spa.SpaError, 'unknown key'):
+            self.listener.open(datagram('OPEN ME'), '192.0.2.1')
+        self.assertEqual(self.listener.open(datagram('OPEN ME', 'client2'), '192.0.2.1')[0], 'client2')
+
+    def test_keys_are_reloaded_without_knocks(self):
+        config.SPA_KEYS_RELOAD_INTERVAL = 0.01
+        # Left open: the listener thread keeps running until the tests end
+        sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        sock.bind(('127.0.0.1', 0))
+        self.listener.sock = sock
+        self.listener.start()
+        os.unlink(os.path.join(self.keys_dir, 'client1.spa'))
+        deadline = time.monotonic() + 5
+        while self.listener.keys and time.monotonic() < deadline:
+            time.sleep(0.01)
+        self.assertEqual(self.listener.keys, {})
+
+    def test_no_reload_interval(self):
+        config.SPA_KEYS_RELOAD_INTERVAL = None
+        os.unlink(os.path.join(self.keys_dir, 'client1.spa'))
+        self.listener.check_keys()
+        self.assertEqual(list(self.listener.keys), ['client1'])
+        self.listener.reload_keys()
+        self.assertEqual(self.listener.keys, {})
+
+    def test_invalid_keys_keep_the_current_ones(self):
+        with open(os.path.join(self.keys_dir, 'client2.spa'), 'w') as key_file:
+            key_file.write('not hex\n')
+        self.listener.check_keys()
+        self.assertEqual(list(self.listener.keys), ['client1'])
+
+class ReplayCacheTest(unittest.TestCase):
+
+    def test_nonces_are_forgotten_after_the_window(self):
+        cache = spa.ReplayCache(30)
+        self.assertTrue(cache.check_and_add('nonce', 1000))
+        self.assertFalse(cache.check_and_add('nonce', 1059))
+        self.assertTrue(cache.check_and_add('other', 1061))
+        self.assertTrue(cache.check_and_add('nonce', 1061))
+
+if __name__ == '__main__':
+    unittest.main()
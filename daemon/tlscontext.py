@@ -0,0 +1,88 @@
+"""
+TLS context of openmed, rebuilt when the certificate revocation list changes
+or the configuration is reloaded.
+
+Python cannot remove anything from the verification store of an SSLContext, so
+a new CRL is loaded into a new context, which then replaces the current one.
+New connections use the new context, while the handshakes in progress finish
+with the old one. The lookup of a certificate in the CRL is done in memory.
+
+A new context also has new session ticket keys. Resumed sessions skip the
+certificate checks, so this is what keeps the clients whose certificates were
+just revoked from resuming their sessions.
+"""
+
+import logging
+import os
+import threading
+import time
+
+import config
+
+logger = logging.getLogger('openme_logger')
+
+def file_stamp(path):
+    # Changes whenever the file is written or replaced. None if it is missing.
+    try:
+        stat = os.stat(path)
+    except OSError:
+        return None
+    return (stat.st_ino, stat.st_size, stat.st_mtime_ns)
+
+class ReloadingContext:
+    """
+    Holds the current SSLContext, built by `create`. Once started, checks the
+    CRL file every config.CRL_RELOAD_INTERVAL seconds and swaps in a new
+    context when it changed. reload() also swaps one in, e.g. after the
+    certificates or the configuration changed. A context that cannot be built
+    keeps the current one.
+    """
+
+    def __init__(self, create):
+        self.create = create
+        self.crl_stamp = file_stamp(config.CRL_FILE) if config.CRL_FILE else None
+        self.context = create()
+        self.checked = time.monotonic()
+        self.thread = threading.Thread(target=self.run, name='openmed-crl', daemon=True)
+
+    def start(self):
+        self.thread.start()
+
+    def current(self):
+        # The context for a new connection
+        return self.context
+
+    def reload(self):
+        # Build a new context and swap it in. Returns True if it was swapped
+        self.crl_stamp = file_stamp(config.CRL_FILE) if config.CRL_FILE else None
+        try:
+            context = self.create()
+        except Exception as e:
+            logger.error(f"openmed: Could not reload the TLS context, keeping the current one: {e}")
+            return False
+        self.context = context
+        return True
+
+    def reload_changed(self):
+        # Reload if the CRL file changed. Returns True if a context was swapped in
+        # CRL_FILE may be set or unset by a reload of the configuration
+        if not config.CRL_FILE or file_stamp(config.CRL_FILE) == self.crl_stamp:
+            return False
+        if not self.reload():
+            return False
+        logger.info(f"openmed: Reloaded the revocation list {config.CRL_FILE}")
+        return True
+
+    def check(self):
+        # reload_changed() at most every CRL_RELOAD_INTERVAL seconds, for the
+        # multi-process master, which cannot start the thread
+        now = time.monotonic()
+        if now < self.checked + config.CRL_RELOAD_INTERVAL:
+            return False
+        self.checked = now
+        return self.reload_changed()
+
+    def run(self):
+        while True:
+            time.sleep(config.CRL_RELOAD_INTERVAL)
+            self.reload_changed()
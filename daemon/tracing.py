@@ -0,0 +1,211 @@
+"""
+Sampled traces of the knocks, to find which stage a slow knock spent its time in.
+
+A trace is started when a worker picks up a connection and records the spans
+of its stages: accept (waiting for a free worker), handshake, recv, parse,
+authz, commit (the firewall) and reply. Each JSON request of a persistent
+connection gets a trace of its own. TRACE_SAMPLE_RATE of the traces are kept,
+and every trace slower than TRACE_SLOW_THRESHOLD, so the latency spikes are
+never missed. Kept traces go to a ring buffer of the last TRACE_BUFFER_SIZE
+ones, dumped by "openmectl.py trace", and to an OpenTelemetry collector if
+TRACE_OTLP_ENDPOINT is set (OTLP/HTTP with JSON).
+
+In multi-process mode the workers forward their traces to the firewall writer,
+where the administration socket is, in a background thread.
+"""
+
+import collections
+import contextlib
+import json
+import logging
+import os
+import queue
+import random
+import threading
+import time
+import urllib.request
+
+import config
+import metrics
+
+logger = logging.getLogger('openme_logger')
+
+traces_dropped = metrics.Counter('openmed_traces_dropped_total', 'Traces dropped because the trace queue was full')
+
+# Stage span of the traces that are not recorded
+NULL_SPAN = contextlib.nullcontext()
+
+class Trace:
+
+    def __init__(self, started, client, sampled):
+        # started is the perf_counter() time the connection was accepted
+        self.started = started
+        self.sampled = sampled
+        self.attributes = {'client': client}
+        self.spans = []
+        self.finished = False
+
+    @contextlib.contextmanager
+    def span(self, name):
+        # Context manager recording the time spent in its block as a stage
+        started = time.perf_counter()
+        try:
+            yield
+        finally:
+            self.spans.append((name, started, time.perf_counter()))
+
+    def add_span(self, name, started, ended):
+        self.spans.append((name, started, ended))
+
+    def set(self, **attributes):
+        self.attributes.update(attributes)
+
+    def discard(self):
+        self.finished = True
+
+    def finish(self):
+        # Keep the trace if sampled or slow. Only the first call counts
+        if self.finished:
+            return
+        self.finished = True
+        ended = time.perf_counter()
+        duration = ended - self.started
+        if not self.sampled and not (config.TRACE_SLOW_THRESHOLD and duration >= config.TRACE_SLOW_THRESHOLD):
+            return
+        record([{
+            'trace_id': os.urandom(16).hex(),
+            'start': time.time() - duration,
+            'duration': duration,
+            'attributes': self.attributes,
+            'spans': [{'name': name, 'start': started - self.started, 'duration': ended - started}
+                      for name, started, ended in self.spans],
+        }])
+
+class NullTrace:
+    """
+    Stands for the traces that are neither sampled nor checked for slowness.
+    """
+
+    def span(self, name):
+        return NULL_SPAN
+
+    def add_span(self, name, started, ended):
+        pass
+
+    def set(self, **attributes):
+        pass
+
+    def discard(self):
+        pass
+
+    def finish(self):
+        pass
+
+NULL_TRACE = NullTrace()
+
+def start(started, client):
+    # Trace of a connection accepted at started (perf_counter() time)
+    sampled = random.random() < config.TRACE_SAMPLE_RATE
+    if not sampled and not config.TRACE_SLOW_THRESHOLD:
+        return NULL_TRACE
+    return Trace(started, client, sampled)
+
+def record(traces):
+    # Keep finished traces, of this process or forwarded by the workers
+    if forwarder is not None:
+        forwarder.submit(traces)
+        return
+    with lock:
+        buffer.extend(traces)
+    if exporter is not None:
+        exporter.submit(traces)
+
+def recent(limit=None, min_duration=0):
+    # The last traces kept, oldest first
+    with lock:
+        traces = [trace for trace in buffer if trace['duration'] >= min_duration]
+    return traces[-limit:] if limit else traces
+
+class Shipper:
+    """
+    Sends the traces in batches from a background thread, so the request path
+    never waits for it. Traces that do not fit in the queue are dropped.
+    """
+
+    def __init__(self, send, name):
+        self.send = send
+        self.pending = queue.Queue(maxsize=config.TRACE_BUFFER_SIZE)
+        self.thread = threading.Thread(target=self.run, name=name, daemon=True)
+
+    def start(self):
+        self.thread.start()
+
+    def submit(self, traces):
+        for trace in traces:
+            try:
+                self.pending.put_nowait(trace)
+            except queue.Full:
+                traces_dropped.inc()
+
+    def run(self):
+        while True:
+            batch = [self.pending.get()]
+            while len(batch) < 100:
+                try:
+                    batch.append(self.pending.get_nowait())
+                except queue.Empty:
+                    break
+            try:
+                self.send(batch)
+            except Exception as e:
+                traces_dropped.inc(len(batch))
+                logger.error(f"Could not send {len(batch)} traces: {e}")
+
+def start_forwarding(send):
+    # In the workers of the multi-process mode: send(traces) to the writer
+    global forwarder
+    forwarder = Shipper(send, 'openmed-traces')
+    forwarder.start()
+
+def start_export(endpoint):
+    # Post the traces to an OTLP/HTTP collector, e.g. http://localhost:4318/v1/traces
+    global exporter
+    exporter = Shipper(lambda traces: post_otlp(endpoint, traces), 'openmed-otlp')
+    exporter.start()
+
+def otlp_attributes(attributes):
+    return [{'key': key, 'value': {'intValue': str(value)} if isinstance(value, int) else {'stringValue': str(value)}}
+            for key, value in attributes.items()]
+
+def otlp_spans(trace):
+    # The trace as a root span, with a child span per stage
+    start = int(trace['start'] * 1e9)
+    root_id = os.urandom(8).hex()
+    spans = [{
+        'traceId': trace['trace_id'], 'spanId': root_id, 'name': 'knock', 'kind': 2,
+        'startTimeUnixNano': str(start), 'endTimeUnixNano': str(start + int(trace['duration'] * 1e9)),
+        'attributes': otlp_attributes(trace['attributes']),
+    }]
+    for span in trace['spans']:
+        span_start = start + int(span['start'] * 1e9)
+        spans.append({
+            'traceId': trace['trace_id'], 'spanId': os.urandom(8).hex(), 'parentSpanId': root_id,
+            'name': span['name'], 'kind': 1,
+            'startTimeUnixNano': str(span_start), 'endTimeUnixNano': str(span_start + int(span['duration'] * 1e9)),
+        })
+    return spans
+
+def post_otlp(endpoint, traces):
+    body = {'resourceSpans': [{
+        'resource': {'attributes': otlp_attributes({'service.name': 'openmed', 'host.name': os.uname().nodename})},
+        'scopeSpans': [{'scope': {'name': 'openmed'}, 'spans': [span for trace in traces for span in otlp_spans(trace)]}],
+    }]}
+    request = urllib.request.Request(endpoint, json.dumps(body).encode(), {'Content-Type': 'application/json'})
+    with urllib.request.urlopen(request, timeout=5) as reply:
+        reply.read()
+
+# The last traces kept, and where they go in the workers or to the collector
+lock = threading.Lock()
+buffer = collections.deque(maxlen=config.TRACE_BUFFER_SIZE)
+forwarder = None
+exporter = None
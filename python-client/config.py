@@ -7,6 +7,10 @@ CLIENT_CERT='/etc/openme/client.crt'
 CLIENT_KEY='/etc/openme/client.key'
 CA_CERT='/etc/openme/ca.crt'
 
+# Key for single packet (--spa) knocks. The name of the file, without the .spa
+# extension, identifies the key in the daemon
+SPA_KEY_FILE='/etc/openme/client.spa'
+
 # If debug is set to True, then it uses the certs in cert
 DEBUG = True
 
@@ -14,3 +18,4 @@ if DEBUG:
     CLIENT_CERT='../certs/client.crt'
     CLIENT_KEY='../certs/client.key'
     CA_CERT='../certs/ca.crt'
+    SPA_KEY_FILE='../certs/client.spa'
@@ -1,24 +1,264 @@
 import argparse
+import asyncio
+import json
+import os
+import random
 import ssl
 import socket
+import struct
+import threading
+import time
 
 import config
 
 # Parse command-line arguments
 parser = argparse.ArgumentParser()
-parser.add_argument("-s", "--server", default=config.DEFAULT_SERVER, help="Server address")
+parser.add_argument("-s", "--server", nargs="+", default=[config.DEFAULT_SERVER], help="Server addresses, all knocked at the same time")
 parser.add_argument("-p", "--port", type=int, default=config.DEFAULT_PORT, help="Server port")
 parser.add_argument("-i", "--ip-address", help="Open ports to this IP address (default: your IP)")
+parser.add_argument("--interval", type=float, help="Keep running and knock again every INTERVAL seconds, resuming the TLS session")
+parser.add_argument("--spa", action="store_true", help="Knock with a single UDP packet instead of a TLS connection")
+parser.add_argument("--targets", nargs="+", help="Open ports to all these IP addresses and networks in a single request")
+parser.add_argument("--ports", nargs="+", help="Only open these ports or port ranges (e.g. 80 8000-8010)")
+parser.add_argument("--protos", nargs="+", choices=["tcp", "udp"], help="Only open these protocols")
+parser.add_argument("--keepalive", action="store_true", help="Keep one connection open and send heartbeats on it to keep the ports open, reconnecting if it is lost")
+parser.add_argument("--all-addresses", action="store_true", help="Knock every IPv4 and IPv6 address of each server name")
+parser.add_argument("--timeout", type=float, default=10, help="Seconds to wait for each server, retries included")
 args = parser.parse_args()
 
-# Connect to the server using SSL
-#context = ssl.create_default_context(ssl.Purpose.SERVER_AUTH)
-context = ssl.create_default_context(ssl.Purpose.CLIENT_AUTH)
-context.load_cert_chain(certfile=config.CLIENT_CERT, keyfile=config.CLIENT_KEY)
-context.load_verify_locations(cafile=config.CA_CERT)
-
-with socket.create_connection((args.server, args.port)) as sock:
-    with context.wrap_socket(sock, server_hostname=args.server) as secure_sock:
-        # Send the appropriate message based on the presence of IP address
-        message = "OPEN ME" if args.ip_address is None else f"OPEN {args.ip_address}"
-        secure_sock.sendall(message.encode())
\ No newline at end of file
+def create_context():
+    # The server certificate is verified against the CA, but not its hostname,
+    # so the server can be reached by IP address
+    context = ssl.SSLContext(ssl.PROTOCOL_TLS_CLIENT)
+    context.check_hostname = False
+    context.load_cert_chain(certfile=config.CLIENT_CERT, keyfile=config.CLIENT_KEY)
+    context.load_verify_locations(cafile=config.CA_CERT)
+    return context
+
+def servers():
+    # (name, address) of the servers to knock. Without --all-addresses, the
+    # address is the name, and the first address that accepts is used
+    if not args.all_addresses:
+        return [(name, name) for name in args.server]
+    found = []
+    for name in args.server:
+        try:
+            addresses = [address[0] for _, _, _, _, address in socket.getaddrinfo(name, args.port, type=socket.SOCK_STREAM)]
+        except socket.gaierror:
+            # Knocking it reports the error along with the other servers
+            addresses = [name]
+        for address in addresses:
+            if (name, address) not in found:
+                found.append((name, address))
+    return found
+
+def knock(context, server, session=None):
+    # Connect to the server using SSL, resuming the previous session if any,
+    # and send the open request. Returns the reply, and the session to resume
+    # in the next knock. TLS 1.3 session tickets arrive after the handshake,
+    # so they have been read along with the reply.
+    name, address = server
+    with socket.create_connection((address, args.port), timeout=args.timeout) as sock:
+        with context.wrap_socket(sock, server_hostname=name, session=session) as secure_sock:
+            secure_sock.sendall(json.dumps(open_request()).encode() + b"\n")
+            return read_reply(secure_sock), secure_sock.session
+
+def knock_and_retry(context, server, session=None):
+    # Knock again only when the grant may not have been applied: no reply, or
+    # the server could not update its firewall. Other errors are final.
+    for attempt in range(KNOCK_ATTEMPTS):
+        try:
+            reply, session = knock(context, server, session)
+        except ssl.SSLError as e:
+            # Such as a revoked certificate, knocking again would not help
+            return {"status": "error", "code": 403, "error": str(e)}, session
+        except (OSError, ValueError) as e:
+            reply = {"status": "error", "error": str(e)}
+        if reply.get("code") not in RETRY_CODES:
+            break
+        if attempt < KNOCK_ATTEMPTS - 1:
+            time.sleep(random.uniform(0.5, 1) * 2 ** attempt)
+    return reply, session
+
+def in_thread(function, *function_args):
+    # Future of function(*function_args), run in a daemon thread. Unlike
+    # asyncio.to_thread, the program does not wait for the threads of the
+    # servers that timed out before exiting
+    loop = asyncio.get_running_loop()
+    future = loop.create_future()
+
+    def resolve(outcome, value):
+        if not future.done():
+            outcome(value)
+
+    def run():
+        try:
+            result = function(*function_args)
+            outcome = future.set_result
+        except BaseException as e:
+            result, outcome = e, future.set_exception
+        try:
+            loop.call_soon_threadsafe(resolve, outcome, result)
+        except RuntimeError:
+            # The loop is gone, nobody is waiting anymore
+            pass
+
+    threading.Thread(target=run, daemon=True).start()
+    return future
+
+async def knock_server(context, server, session):
+    # Knock one server without holding up the others. The knock runs in a
+    # thread since asyncio streams cannot resume TLS sessions
+    try:
+        return await asyncio.wait_for(in_thread(knock_and_retry, context, server, session), args.timeout)
+    except asyncio.TimeoutError:
+        return {"status": "error", "error": f"no reply within {args.timeout:g}s"}, session
+
+async def knock_all(context, sessions):
+    # Knock all the servers at the same time, so it takes as long as the
+    # slowest one. sessions maps each server to its session to resume, and is
+    # updated. Returns True if all of them opened the ports.
+    targets = list(sessions)
+    results = await asyncio.gather(*(knock_server(context, server, sessions[server]) for server in targets))
+    for server, (reply, session) in zip(targets, results):
+        sessions[server] = session
+        report(reply, server if len(targets) > 1 else None)
+    return all(reply["status"] == "ok" for reply, _ in results)
+
+def report(reply, server=None):
+    # Print the outcome of a knock, prefixed with the server when there are several
+    if server is None:
+        prefix = ""
+    else:
+        prefix = f"{server[0]}: " if server[0] == server[1] else f"{server[0]} ({server[1]}): "
+    if reply["status"] != "ok":
+        print(f"{prefix}Error: {reply['error']}")
+    elif reply["expires"] is None:
+        print(f"{prefix}{reply['rules']} rules opened")
+    else:
+        print(f"{prefix}{reply['rules']} rules opened until {time.ctime(reply['expires'])}")
+
+def open_request():
+    # JSON open request (see daemon/protocol.py) for the command-line arguments
+    request = {"v": 1, "op": "open"}
+    if args.targets:
+        request["targets"] = args.targets
+    elif args.ip_address:
+        request["targets"] = [args.ip_address]
+    if args.ports:
+        request["ports"] = [int(port) if port.isdigit() else port for port in args.ports]
+    if args.protos:
+        request["protos"] = args.protos
+    return request
+
+def read_reply(secure_sock):
+    # Read one JSON reply, terminated by a newline
+    reply = b""
+    while not reply.endswith(b"\n"):
+        chunk = secure_sock.recv(4096)
+        if not chunk:
+            break
+        reply += chunk
+    # Without a reply, there is no code: the request may not have been served
+    return json.loads(reply) if reply else {"status": "error", "error": "no reply from the server"}
+
+def heartbeat_interval(reply):
+    # --interval, or half the time before either the grant expires or the
+    # server closes the idle connection
+    if args.interval:
+        return args.interval
+    limits = [reply.get("keepalive") or 60]
+    if reply.get("expires") is not None:
+        limits.append(reply["expires"] - time.time())
+    return max(min(limits) / 2, 1)
+
+def persistent_knock(context, server):
+    # Keep one connection open and send the request again on it as a
+    # heartbeat, which extends the grant. When the connection is lost, connect
+    # again after an exponential backoff with jitter, resuming the TLS session
+    name, address = server
+    request = dict(open_request(), keepalive=True, id=0)
+    session = None
+    backoff = 1
+    while True:
+        try:
+            with socket.create_connection((address, args.port), timeout=args.timeout) as sock:
+                # Detect dead connections while waiting between heartbeats
+                sock.setsockopt(socket.SOL_SOCKET, socket.SO_KEEPALIVE, 1)
+                with context.wrap_socket(sock, server_hostname=name, session=session) as secure_sock:
+                    # Heartbeats are far apart, only connecting is bounded
+                    secure_sock.settimeout(None)
+                    while True:
+                        request["id"] += 1
+                        secure_sock.sendall(json.dumps(request).encode() + b"\n")
+                        reply = read_reply(secure_sock)
+                        session = secure_sock.session
+                        if reply.get("id", request["id"]) != request["id"]:
+                            raise ConnectionError(f"reply to request {reply['id']} instead of {request['id']}")
+                        if reply["status"] != "ok":
+                            if reply.get("code") not in RETRY_CODES:
+                                raise SystemExit(f"{name}: Error: {reply['error']}")
+                            raise ConnectionError(reply["error"])
+                        backoff = 1
+                        time.sleep(heartbeat_interval(reply))
+                        if "keepalive" not in reply:
+                            # The server does not keep connections open
+                            break
+        except (OSError, ssl.SSLError, ValueError) as e:
+            delay = random.uniform(backoff / 2, backoff)
+            print(f"Connection to {name} lost ({e}), reconnecting in {delay:.1f}s")
+            time.sleep(delay)
+            backoff = min(backoff * 2, MAX_BACKOFF)
+
+async def persistent_knock_all(context):
+    # One persistent connection per server. Stops at the first server that
+    # refuses the request
+    await asyncio.gather(*(in_thread(persistent_knock, context, server) for server in servers()))
+
+def spa_knock(server):
+    # Send the knock as one datagram, encrypted and authenticated with the SPA
+    # key. The format is described in daemon/spa.py
+    from cryptography.hazmat.primitives.ciphers.aead import AESGCM
+
+    name = os.path.basename(config.SPA_KEY_FILE).rsplit('.', 1)[0].encode()
+    with open(config.SPA_KEY_FILE) as key_file:
+        key = AESGCM(bytes.fromhex(key_file.read().strip()))
+    message = "OPEN ME" if args.ip_address is None else f"OPEN {args.ip_address}"
+
+    header = bytes([1, len(name)]) + name
+    nonce = os.urandom(12)
+    plaintext = struct.pack('>Q', int(time.time() * 1000)) + message.encode()
+    datagram = header + nonce + key.encrypt(nonce, plaintext, header)
+    # The server may be reached over IPv4 or IPv6
+    family, _, _, _, address = socket.getaddrinfo(server[1], args.port, type=socket.SOCK_DGRAM)[0]
+    with socket.socket(family, socket.SOCK_DGRAM) as sock:
+        sock.sendto(datagram, address)
+
+# Longest wait, in seconds, before connecting again with --keepalive
+MAX_BACKOFF = 60
+
+# Knocks are sent again, up to KNOCK_ATTEMPTS times, only when the reply has
+# one of these codes (None: there was no reply)
+KNOCK_ATTEMPTS = 3
+RETRY_CODES = (None, 503)
+
+if args.keepalive:
+    asyncio.run(persistent_knock_all(create_context()))
+elif args.spa:
+    # Datagrams are sent without waiting, there is nothing to run concurrently
+    for server in servers():
+        spa_knock(server)
+    while args.interval:
+        time.sleep(args.interval)
+        for server in servers():
+            spa_knock(server)
+else:
+    context = create_context()
+    sessions = dict.fromkeys(servers())
+    opened = asyncio.run(knock_all(context, sessions))
+    while args.interval:
+        time.sleep(args.interval)
+        opened = asyncio.run(knock_all(context, sessions))
+    # 1 if any of the servers did not open the ports
+    if not opened:
+        raise SystemExit(1)
@@ -0,0 +1,184 @@
+#!/usr/bin/env python3
+"""
+Load generator for openmed: opens concurrent mutual TLS connections, sends a
+knock on each and reports the throughput and latency percentiles.
+
+Each knock is a JSON open request (see daemon/protocol.py), timed from the TCP
+connect until the reply, which comes once the ports are open. Knocks that are
+not granted, e.g. rejected by the rate limit or the policy of the client, or
+that the firewall could not apply, are counted as failed, by reason. Running
+it twice, once against FIREWALL_BACKEND = "stub" and once with the real
+backend, separates the TLS cost from the firewall cost.
+
+Examples:
+  ./openme_bench.py -s 192.168.1.1 -c 32 -n 5000
+  ./openme_bench.py -c 64 -n 20000 --cert-dir ../certs/bench --mode both --unique-ips
+"""
+
+import argparse
+import collections
+import glob
+import ipaddress
+import json
+import multiprocessing
+import os
+import socket
+import ssl
+import threading
+import time
+
+import config
+
+def parse_args():
+    parser = argparse.ArgumentParser(description="Benchmark the knock path of an openme daemon")
+    parser.add_argument("-s", "--server", default=config.DEFAULT_SERVER, help="Server address")
+    parser.add_argument("-p", "--port", type=int, default=config.DEFAULT_PORT, help="Server port")
+    parser.add_argument("-c", "--concurrency", type=int, default=16, help="Concurrent connections per process (default: 16)")
+    parser.add_argument("-P", "--processes", type=int, default=1, help="Client processes, to get past the GIL (default: 1)")
+    parser.add_argument("-n", "--requests", type=int, default=1000, help="Knocks per mode (default: 1000)")
+    parser.add_argument("--cert-dir", help="Use every NAME.crt/NAME.key pair of this directory as a pool of client certificates")
+    parser.add_argument("--mode", choices=["fresh", "resumed", "both"], default="both",
+                        help="Full handshakes, resumed sessions or both (default: both)")
+    parser.add_argument("--unique-ips", action="store_true",
+                        help="Open the ports to a different IP for each knock instead of the own address, so each knock is a new grant")
+    parser.add_argument("--timeout", type=float, default=10, help="Seconds before a knock is counted as failed (default: 10)")
+    return parser.parse_args()
+
+def load_certificates(cert_dir):
+    # (certificate, key) pairs of the pool
+    if cert_dir is None:
+        return [(config.CLIENT_CERT, config.CLIENT_KEY)]
+    pairs = []
+    for cert in sorted(glob.glob(os.path.join(cert_dir, "*.crt"))):
+        key = cert[:-len(".crt")] + ".key"
+        if os.path.basename(cert) != "ca.crt" and os.path.exists(key):
+            pairs.append((cert, key))
+    if not pairs:
+        raise SystemExit(f"No NAME.crt/NAME.key pairs found in {cert_dir}")
+    return pairs
+
+def create_context(cert, key):
+    context = ssl.SSLContext(ssl.PROTOCOL_TLS_CLIENT)
+    context.check_hostname = False
+    context.load_cert_chain(certfile=cert, keyfile=key)
+    context.load_verify_locations(cafile=config.CA_CERT)
+    return context
+
+class KnockFailed(Exception):
+    # The daemon replied, but did not grant the knock
+    pass
+
+def knock(args, context, request, session):
+    # Returns the session to resume in the next knock. Raises KnockFailed if
+    # the reply is not a success, OSError if there is none
+    with socket.create_connection((args.server, args.port), timeout=args.timeout) as sock:
+        with context.wrap_socket(sock, server_hostname=args.server, session=session) as secure_sock:
+            secure_sock.sendall(json.dumps(request).encode() + b"\n")
+            with secure_sock.makefile("rb") as replies:
+                line = replies.readline()
+            if not line:
+                raise OSError("connection closed without a reply")
+            try:
+                reply = json.loads(line)
+            except ValueError:
+                raise KnockFailed("invalid reply")
+            if reply.get("status") != "ok":
+                raise KnockFailed(f"error {reply.get('code')}")
+            return secure_sock.session
+
+def run_process(args, mode, requests, first_request, certificates, results):
+    # Runs args.concurrency threads sharing requests knocks, puts the latencies
+    # of the successful ones and the numbers of failures by reason in results
+    contexts = [create_context(cert, key) for cert, key in certificates]
+    counter = iter(range(first_request, first_request + requests))
+    counter_lock = threading.Lock()
+    latencies = []
+    failures = collections.Counter()
+
+    def run_thread(thread_number):
+        context = contexts[thread_number % len(contexts)]
+        session = None
+        if mode == "resumed":
+            # Warm up: get a session to resume in the timed knocks
+            try:
+                session = knock(args, context, {"v": 1, "op": "open"}, None)
+            except (KnockFailed, ssl.SSLError, OSError):
+                pass
+        while True:
+            with counter_lock:
+                request = next(counter, None)
+            if request is None:
+                return
+            message = {"v": 1, "op": "open"}
+            if args.unique_ips:
+                message["targets"] = [str(ipaddress.IPv4Address(0x0a000001 + request))]
+            start = time.perf_counter()
+            try:
+                new_session = knock(args, context, message, session)
+            except KnockFailed as e:
+                with counter_lock:
+                    failures[str(e)] += 1
+                continue
+            except (ssl.SSLError, OSError):
+                # E.g. reset by the rate limit, or timed out
+                with counter_lock:
+                    failures["no reply"] += 1
+                continue
+            latencies.append(time.perf_counter() - start)
+            if mode == "resumed":
+                session = new_session
+
+    threads = [threading.Thread(target=run_thread, args=(i,)) for i in range(args.concurrency)]
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+    results.put((latencies, failures))
+
+def percentile(sorted_values, fraction):
+    if not sorted_values:
+        return float("nan")
+    return sorted_values[min(len(sorted_values) - 1, int(fraction * len(sorted_values)))]
+
+def run_mode(args, mode, certificates):
+    # Split the knocks among the processes and gather their results
+    results = multiprocessing.Queue()
+    share = args.requests // args.processes
+    processes = []
+    for i in range(args.processes):
+        requests = share if i < args.processes - 1 else args.requests - share * (args.processes - 1)
+        processes.append(multiprocessing.Process(target=run_process, args=(args, mode, requests, i * share, certificates, results)))
+
+    start = time.perf_counter()
+    for process in processes:
+        process.start()
+    latencies = []
+    failures = collections.Counter()
+    for _ in processes:
+        process_latencies, process_failures = results.get()
+        latencies += process_latencies
+        failures.update(process_failures)
+    for process in processes:
+        process.join()
+    elapsed = time.perf_counter() - start
+
+    latencies.sort()
+    reasons = ", ".join(f"{count} {reason}" for reason, count in failures.most_common())
+    print(f"{mode:>8}: {len(latencies)} knocks in {elapsed:.2f}s, {len(latencies) / elapsed:.1f} knocks/s, "
+          f"{sum(failures.values())} failed" + (f" ({reasons})" if reasons else ""))
+    print(f"          latency p50 {percentile(latencies, 0.5) * 1000:.2f}ms"
+          f"  p99 {percentile(latencies, 0.99) * 1000:.2f}ms"
+          f"  p999 {percentile(latencies, 0.999) * 1000:.2f}ms"
+          f"  max {latencies[-1] * 1000 if latencies else float('nan'):.2f}ms")
+
+def main():
+    args = parse_args()
+    certificates = load_certificates(args.cert_dir)
+    print(f"Knocking {args.server}:{args.port} with {args.processes}x{args.concurrency} connections "
+          f"and {len(certificates)} client certificates")
+    modes = ["fresh", "resumed"] if args.mode == "both" else [args.mode]
+    for mode in modes:
+        run_mode(args, mode, certificates)
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,437 @@
+#!/usr/bin/env python3
+"""
+Replays a knock trace against openmed with the real firewall backends, each
+one in a throwaway network namespace, and reports what each backend costs:
+ - the grant latency, from sending a knock to its reply, which only comes once
+   the rule is in the firewall;
+ - the firewall throughput, in rules added and removed per second, and per
+   second spent in the firewall commits, which is what the backend could
+   sustain;
+ - the packet path cost as the number of active grants grows: the time to
+   connect to a protected port from a granted address whose rule is the last
+   one added.
+
+The trace is either synthetic, knocks from --clients addresses arriving at
+--rate per second, or recorded, one "seconds,address" line per knock (see
+--save-trace). The grants last --ttl seconds, so with churn they expire while
+new ones come in. Each backend gets a fresh namespace, linked to this one by a
+veth pair, and a daemon of its own: a copy of the daemon modules with a
+config.py of its own, daemon/config.py followed by the settings of the run.
+Needs root, ip(8) and the tools of the backends: iptables, ipset, nft, or
+bpftool and the XDP program built in daemon/bpf.
+
+Examples:
+  sudo ./openme_replay.py --backends iptables-restore,ipset,nft-set --clients 50000 --rate 2000 --duration 60
+  sudo ./openme_replay.py --trace knocks.csv --backends stub,xdp
+"""
+
+import argparse
+import ipaddress
+import json
+import os
+import random
+import shutil
+import signal
+import socket
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+import urllib.request
+
+import config
+from openme_bench import create_context, percentile
+
+DAEMON_DIR = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "daemon")
+
+# Addresses of the veth pair, on this side and in the namespace
+HOST_ADDRESS = "10.254.254.1"
+NAMESPACE_ADDRESS = "10.254.254.2"
+# The synthetic clients, out of the way of the real networks
+FIRST_CLIENT = ipaddress.IPv4Address("100.64.0.0")
+# The port the grants open, with a listener behind it for the probes
+PROTECTED_PORT = 80
+METRICS_PORT = 9154
+
+# Accepts and closes the probe connections, in the namespace
+LISTENER = f"""
+import socket
+server = socket.create_server(("{NAMESPACE_ADDRESS}", {PROTECTED_PORT}), backlog=1024)
+while True:
+    server.accept()[0].close()
+"""
+
+def parse_args():
+    parser = argparse.ArgumentParser(description="Replay knocks against openmed with each firewall backend, in a network namespace")
+    parser.add_argument("--backends", default="iptables,iptables-restore,ipset,nft-set,xdp",
+                        help="Comma-separated firewall backends to run (default: all but stub)")
+    parser.add_argument("--trace", help="Replay this recorded trace, one \"seconds,address\" line per knock")
+    parser.add_argument("--save-trace", help="Write the synthetic trace to this file, to replay it later")
+    parser.add_argument("--clients", type=int, default=50000, help="Addresses of the synthetic trace (default: 50000)")
+    parser.add_argument("--rate", type=float, default=1000, help="Knocks per second of the synthetic trace (default: 1000)")
+    parser.add_argument("--duration", type=float, default=60, help="Seconds of the synthetic trace (default: 60)")
+    parser.add_argument("--seed", type=int, default=1, help="Seed of the synthetic trace (default: 1)")
+    parser.add_argument("--ttl", type=int, default=30, help="Seconds the grants last (default: 30)")
+    parser.add_argument("-c", "--concurrency", type=int, default=32, help="Persistent connections knocking (default: 32)")
+    parser.add_argument("--probe-every", type=float, default=5, help="Seconds between two packet path measures (default: 5)")
+    parser.add_argument("--probes", type=int, default=200, help="Connections per packet path measure (default: 200)")
+    parser.add_argument("-p", "--port", type=int, default=config.DEFAULT_PORT, help="Port of the daemons")
+    parser.add_argument("--timeout", type=float, default=10, help="Seconds before a knock is counted as failed (default: 10)")
+    return parser.parse_args()
+
+def synthetic_trace(args):
+    # Poisson arrivals of knocks, each one from a random client
+    generator = random.Random(args.seed)
+    trace = []
+    offset = generator.expovariate(args.rate)
+    while offset < args.duration:
+        trace.append((offset, str(FIRST_CLIENT + generator.randrange(args.clients))))
+        offset += generator.expovariate(args.rate)
+    return trace
+
+def load_trace(path):
+    trace = []
+    with open(path) as lines:
+        for line in lines:
+            line = line.strip()
+            if line and not line.startswith("#"):
+                offset, address = line.split(",", 1)
+                trace.append((float(offset), address.strip()))
+    return sorted(trace)
+
+def save_trace(path, trace):
+    with open(path, "w") as lines:
+        for offset, address in trace:
+            lines.write(f"{offset:.6f},{address}\n")
+
+def run(command, check=True):
+    return subprocess.run(command, check=check, capture_output=True, text=True)
+
+class Namespace:
+    """
+    A network namespace linked to this one by a veth pair.
+    """
+
+    def __init__(self, name):
+        self.name = name
+        # Interface names are at most 15 characters long
+        self.host_link = f"orp{os.getpid() % 100000}h"
+        self.inner_link = f"orp{os.getpid() % 100000}n"
+
+    def create(self):
+        run(["ip", "netns", "add", self.name])
+        run(["ip", "link", "add", self.host_link, "type", "veth", "peer", "name", self.inner_link])
+        run(["ip", "link", "set", self.inner_link, "netns", self.name])
+        run(["ip", "addr", "add", f"{HOST_ADDRESS}/30", "dev", self.host_link])
+        run(["ip", "link", "set", self.host_link, "up"])
+        run(["ip", "-n", self.name, "addr", "add", f"{NAMESPACE_ADDRESS}/30", "dev", self.inner_link])
+        run(["ip", "-n", self.name, "link", "set", self.inner_link, "up"])
+        run(["ip", "-n", self.name, "link", "set", "lo", "up"])
+
+    def popen(self, command, **kwargs):
+        return subprocess.Popen(["ip", "netns", "exec", self.name] + command, start_new_session=True, **kwargs)
+
+    def delete(self):
+        # Deleting the namespace deletes the veth pair, and the XDP program on it
+        run(["ip", "link", "del", self.host_link], check=False)
+        run(["ip", "netns", "del", self.name], check=False)
+
+def stop(process):
+    if process is None or process.poll() is not None:
+        return
+    os.killpg(process.pid, signal.SIGTERM)
+    try:
+        process.wait(5)
+    except subprocess.TimeoutExpired:
+        os.killpg(process.pid, signal.SIGKILL)
+        process.wait()
+
+def daemon_settings(args, backend, workdir, namespace):
+    # Overrides of daemon/config.py for the daemon of a backend
+    return {
+        "DEBUG": False,
+        "FIREWALL_BACKEND": backend,
+        "LISTENING_PORT": args.port,
+        "OPEN_PORTS": [PROTECTED_PORT],
+        "POLICIES": {},
+        "DEFAULT_POLICY": {"protos": ["tcp"], "ttl": args.ttl, "third_party": True},
+        "RATE_LIMIT_RATE": None,
+        "GRANT_JOURNAL": os.path.join(workdir, "grants.db"),
+        "ADMIN_SOCKET": os.path.join(workdir, "openmed.sock"),
+        "LOG_BACKEND": "file",
+        "LOG_FILE": os.path.join(workdir, "openmed.log"),
+        "METRICS_PORT": METRICS_PORT,
+        "METRICS_ADDRESS": NAMESPACE_ADDRESS,
+        "PEER_PORT": None,
+        "PEERS": [],
+        "SPA_PORT": None,
+        "XDP_INTERFACES": [namespace.inner_link],
+        "XDP_MODE": "xdpgeneric",
+        "BPF_OBJECT": os.path.abspath(os.path.join(DAEMON_DIR, "bpf", "openme_xdp.o")),
+        "BPF_PIN_DIR": f"/sys/fs/bpf/{namespace.name}",
+    }
+
+def install_daemon(args, backend, workdir, namespace):
+    # Copy the daemon modules to workdir/daemon, with a complete config.py:
+    # the one of the tree, then the settings of this run. Returns openmed.py
+    daemon_dir = os.path.join(workdir, "daemon")
+    os.makedirs(daemon_dir, exist_ok=True)
+    for name in os.listdir(DAEMON_DIR):
+        if name.endswith(".py") and name != "config.py":
+            shutil.copy(os.path.join(DAEMON_DIR, name), daemon_dir)
+    with open(os.path.join(DAEMON_DIR, "config.py")) as original, open(os.path.join(daemon_dir, "config.py"), "w") as settings:
+        settings.write(original.read())
+        settings.write("\n# Settings of openme_replay.py\n")
+        for name, value in daemon_settings(args, backend, workdir, namespace).items():
+            settings.write(f"{name} = {value!r}\n")
+    return os.path.join(daemon_dir, "openmed.py")
+
+def start_daemon(args, backend, workdir, namespace):
+    # Start openmed in the namespace and wait until it accepts connections. It
+    # runs from daemon/, so the relative paths of config.py still work
+    openmed = install_daemon(args, backend, workdir, namespace)
+    with open(os.path.join(workdir, "openmed.out"), "w") as output:
+        process = namespace.popen([sys.executable, openmed], cwd=DAEMON_DIR, stdout=output, stderr=subprocess.STDOUT)
+    deadline = time.monotonic() + 15
+    while time.monotonic() < deadline:
+        if process.poll() is not None:
+            break
+        try:
+            socket.create_connection((NAMESPACE_ADDRESS, args.port), timeout=1).close()
+            return process
+        except OSError:
+            time.sleep(0.1)
+    stop(process)
+    log = ""
+    for name in ("openmed.out", "openmed.log"):
+        if os.path.exists(os.path.join(workdir, name)):
+            with open(os.path.join(workdir, name)) as lines:
+                log += lines.read()
+    raise RuntimeError(f"openmed did not start with the {backend} backend:\n" + "\n".join(log.splitlines()[-10:]))
+
+def connect(args, context):
+    # A persistent connection to the daemon, and the file its replies are read from
+    sock = socket.create_connection((NAMESPACE_ADDRESS, args.port), timeout=args.timeout)
+    secure_sock = context.wrap_socket(sock, server_hostname=NAMESPACE_ADDRESS)
+    return secure_sock, secure_sock.makefile("rb")
+
+def knock(connection, targets=None):
+    # Grant the targets, or the address of this side, and wait for the reply
+    secure_sock, replies = connection
+    request = {"v": 1, "op": "open", "keepalive": True}
+    if targets:
+        request["targets"] = targets
+    secure_sock.sendall(json.dumps(request).encode() + b"\n")
+    line = replies.readline()
+    if not line:
+        raise OSError("the daemon closed the connection")
+    reply = json.loads(line)
+    if reply.get("status") != "ok":
+        raise OSError(f"error {reply.get('code')}: {reply.get('error')}")
+
+def admin_request(path, message):
+    with socket.socket(socket.AF_UNIX, socket.SOCK_STREAM) as sock:
+        sock.connect(path)
+        sock.sendall(json.dumps(message).encode() + b"\n")
+        with sock.makefile("rb") as reply:
+            return json.loads(reply.readline())
+
+def scrape_metrics():
+    # Samples of the daemon metrics, by name with their labels
+    samples = {}
+    with urllib.request.urlopen(f"http://{NAMESPACE_ADDRESS}:{METRICS_PORT}/metrics", timeout=5) as reply:
+        for line in reply.read().decode().splitlines():
+            if line and not line.startswith("#"):
+                name, value = line.rsplit(" ", 1)
+                samples[name] = float(value)
+    return samples
+
+def metric_sum(samples, prefix):
+    # Sum of the series of a metric, whatever their labels
+    return sum(value for name, value in samples.items() if name == prefix or name.startswith(prefix + "{"))
+
+class Replayer:
+    """
+    Sends the knocks of the trace at their time, over concurrent persistent
+    connections, and records their latencies. A knock due while all the
+    connections are busy goes late, and its lag is recorded too.
+    """
+
+    def __init__(self, args, context, trace):
+        self.args = args
+        self.context = context
+        self.trace = trace
+        self.next = 0
+        self.lock = threading.Lock()
+        self.latencies = []
+        self.max_lag = 0
+        self.failures = 0
+
+    def run(self):
+        self.started = time.perf_counter()
+        threads = [threading.Thread(target=self.run_connection) for _ in range(self.args.concurrency)]
+        for thread in threads:
+            thread.start()
+        for thread in threads:
+            thread.join()
+        self.elapsed = time.perf_counter() - self.started
+
+    def run_connection(self):
+        connection = None
+        while True:
+            with self.lock:
+                index = self.next
+                self.next += 1
+            if index >= len(self.trace):
+                break
+            offset, address = self.trace[index]
+            delay = self.started + offset - time.perf_counter()
+            if delay > 0:
+                time.sleep(delay)
+            start = time.perf_counter()
+            try:
+                if connection is None:
+                    connection = connect(self.args, self.context)
+                knock(connection, [address])
+            except (OSError, ValueError):
+                if connection is not None:
+                    connection[0].close()
+                connection = None
+                with self.lock:
+                    self.failures += 1
+                continue
+            self.latencies.append(time.perf_counter() - start)
+            self.max_lag = max(self.max_lag, -delay)
+        if connection is not None:
+            connection[0].close()
+
+class Prober:
+    """
+    Measures the packet path every --probe-every seconds: revokes then grants
+    the address of this side again, so its rule is the last one, and times
+    connections to the protected port from it.
+    """
+
+    def __init__(self, args, context, admin_socket):
+        self.args = args
+        self.context = context
+        self.admin_socket = admin_socket
+        self.measures = []
+        self.done = threading.Event()
+
+    def measure(self):
+        admin_request(self.admin_socket, {"v": 1, "op": "revoke", "filter": {"ip": HOST_ADDRESS}})
+        connection = connect(self.args, self.context)
+        try:
+            knock(connection)
+        finally:
+            connection[0].close()
+        active = scrape_metrics().get("openmed_active_grants", 0)
+        times = []
+        for _ in range(self.args.probes):
+            with socket.socket() as sock:
+                sock.settimeout(1)
+                sock.bind((HOST_ADDRESS, 0))
+                start = time.perf_counter()
+                try:
+                    sock.connect((NAMESPACE_ADDRESS, PROTECTED_PORT))
+                except OSError:
+                    continue
+                times.append(time.perf_counter() - start)
+        times.sort()
+        self.measures.append((int(active), times, self.args.probes - len(times)))
+        print(f"    {int(active):>8} active grants: connect p50 {percentile(times, 0.5) * 1e6:.0f}us"
+              f"  p99 {percentile(times, 0.99) * 1e6:.0f}us  {self.args.probes - len(times)} failed")
+
+    def run(self):
+        while not self.done.wait(self.args.probe_every):
+            try:
+                self.measure()
+            except (OSError, ValueError) as e:
+                print(f"    probe failed: {e}")
+
+    def start(self):
+        self.thread = threading.Thread(target=self.run, daemon=True)
+        self.thread.start()
+
+    def stop(self):
+        self.done.set()
+        self.thread.join()
+
+def run_backend(args, backend, trace, context):
+    # Replay the trace against a daemon with this backend, in a namespace of its own
+    namespace = Namespace(f"openme-replay-{os.getpid()}")
+    workdir = tempfile.mkdtemp(prefix="openme-replay-")
+    daemon = listener = None
+    try:
+        namespace.create()
+        listener = namespace.popen([sys.executable, "-c", LISTENER])
+        daemon = start_daemon(args, backend, workdir, namespace)
+        prober = Prober(args, context, os.path.join(workdir, "openmed.sock"))
+        print(f"{backend}: baseline")
+        prober.measure()
+        before = scrape_metrics()
+
+        print(f"{backend}: replaying {len(trace)} knocks")
+        prober.start()
+        replayer = Replayer(args, context, trace)
+        replayer.run()
+        prober.stop()
+        after = scrape_metrics()
+    finally:
+        stop(daemon)
+        stop(listener)
+        namespace.delete()
+        shutil.rmtree(f"/sys/fs/bpf/{namespace.name}", ignore_errors=True)
+        shutil.rmtree(workdir, ignore_errors=True)
+
+    rules = metric_sum(after, "openmed_firewall_rules_total") - metric_sum(before, "openmed_firewall_rules_total")
+    commits = metric_sum(after, "openmed_firewall_apply_seconds_count") - metric_sum(before, "openmed_firewall_apply_seconds_count")
+    commit_time = metric_sum(after, "openmed_firewall_apply_seconds_sum") - metric_sum(before, "openmed_firewall_apply_seconds_sum")
+    latencies = sorted(replayer.latencies)
+    result = {
+        "backend": backend,
+        "p50": percentile(latencies, 0.5),
+        "p99": percentile(latencies, 0.99),
+        "rules_per_second": rules / replayer.elapsed,
+        "capacity": rules / commit_time if commit_time else float("nan"),
+        "packet_path": prober.measures[-1] if prober.measures else (0, [], 0),
+        "baseline": prober.measures[0][1],
+    }
+    print(f"{backend}: {len(latencies)} knocks in {replayer.elapsed:.2f}s, {replayer.failures} failed, "
+          f"at most {replayer.max_lag * 1000:.0f}ms late")
+    print(f"    grant latency p50 {result['p50'] * 1000:.2f}ms  p99 {result['p99'] * 1000:.2f}ms"
+          f"  p999 {percentile(latencies, 0.999) * 1000:.2f}ms")
+    print(f"    {int(rules)} rules added and removed in {int(commits)} commits, {result['rules_per_second']:.0f} rules/s, "
+          f"{result['capacity']:.0f} rules per second of commit")
+    return result
+
+def main():
+    args = parse_args()
+    if os.geteuid() != 0:
+        sys.exit("openme_replay.py creates network namespaces and needs root")
+    trace = load_trace(args.trace) if args.trace else synthetic_trace(args)
+    if args.save_trace:
+        save_trace(args.save_trace, trace)
+    context = create_context(config.CLIENT_CERT, config.CLIENT_KEY)
+    print(f"Replaying {len(trace)} knocks from {len({address for _, address in trace})} addresses "
+          f"over {trace[-1][0] if trace else 0:.0f}s, grants of {args.ttl}s")
+
+    results = []
+    for backend in args.backends.split(","):
+        try:
+            results.append(run_backend(args, backend, trace, context))
+        except (RuntimeError, OSError, subprocess.CalledProcessError) as e:
+            print(f"{backend}: skipped, {getattr(e, 'stderr', None) or e}")
+
+    # One line per backend, to compare them
+    print(f"\n{'backend':<18} {'p50 ms':>8} {'p99 ms':>8} {'rules/s':>8} {'capacity':>9} {'grants':>8} {'connect us':>11} {'baseline us':>12}")
+    for result in results:
+        active, times, failed = result["packet_path"]
+        print(f"{result['backend']:<18} {result['p50'] * 1000:>8.2f} {result['p99'] * 1000:>8.2f} "
+              f"{result['rules_per_second']:>8.0f} {result['capacity']:>9.0f} {active:>8} "
+              f"{percentile(times, 0.5) * 1e6:>11.0f} {percentile(result['baseline'], 0.5) * 1e6:>12.0f}")
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,40 @@
+#!/bin/bash
+
+# Usage: ./revoke_cert.sh client_name
+# Revokes the certificate of a client, e.g. one of a lost laptop, and updates
+# the certificate revocation list (CRL) in ./certs/crl.pem. A daemon with
+# CRL_FILE set to it reloads the list on its own, without a restart.
+export EASYRSA_CRL_DAYS=9999
+
+# Validate the number of arguments
+if [[ $# -ne 1 ]]; then
+  echo "Usage: revoke_cert.sh client_name"
+  exit 1
+fi
+
+if [[ ! $1 =~ ^[a-zA-Z0-9._\-]+$ ]]; then
+  echo "The client name can only contain letters, numbers and the symbols - _ and ."
+  exit 3
+fi
+
+cd easyrsa
+echo "Revoking the certificate of ${1}..."
+./easyrsa revoke ${1} || exit 4
+echo "Generating the certificate revocation list..."
+./easyrsa gen-crl || exit 5
+
+# Copy it next to the other certs, replacing the old list in one rename so the
+# daemon never reads a partial file
+echo "Copying ./pki/crl.pem to ../certs/"
+cp ./pki/crl.pem ../certs/crl.pem.new && mv ../certs/crl.pem.new ../certs/crl.pem
+cd ..
+
+# The SPA key of the client is not valid anymore either. The daemon keeps it
+# in memory until it notices the file is gone
+if [ -f ./certs/${1}.spa ]; then
+  echo "Removing the SPA key ./certs/${1}.spa"
+  rm ./certs/${1}.spa
+  echo "The daemon drops the key within SPA_KEYS_RELOAD_INTERVAL, or at once with: kill -HUP <pid of openmed>"
+fi
+
+echo "Done."
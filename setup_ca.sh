@@ -1,5 +1,23 @@
 #!/bin/sh
 
+# Usage: ./setup_ca.sh [rsa|ec|ed]
+# The optional argument is the key algorithm of the CA and of all the
+# certificates issued by it (default: rsa).
+#  - rsa: RSA keys (easyrsa default)
+#  - ec:  ECDSA keys on the prime256v1 curve
+#  - ed:  Ed25519 keys
+# ECDSA and Ed25519 keys make the TLS handshakes much cheaper for the server.
+algo=${1:-rsa}
+case $algo in
+  rsa) ;;
+  ec) curve=prime256v1 ;;
+  ed) curve=ed25519 ;;
+  *)
+    echo "Usage: ./setup_ca.sh [rsa|ec|ed]"
+    exit 3
+    ;;
+esac
+
 # Check if the user is root (superuser)
 if [[ $EUID -eq 0 ]]; then
   echo "This script cannot not be run as root."
@@ -29,25 +47,44 @@ echo `pwd`
 echo Initializing the public key infrastructure
 ./easyrsa init-pki
 
+# Save the key algorithm in the pki vars, so that add_cert.sh uses it too
+if [ $algo != rsa ]; then
+  echo "Using $algo keys ($curve)"
+  echo "set_var EASYRSA_ALGO $algo" >> ./pki/vars
+  echo "set_var EASYRSA_CURVE $curve" >> ./pki/vars
+fi
+
 echo Building the certificate authority
 ./easyrsa build-ca
 
 
 export EASYRSA_CERT_EXPIRE=9999
+export EASYRSA_CRL_DAYS=9999
 
 echo Generating server certificate server
 ./easyrsa gen-req server nopass
 ./easyrsa sign-req server server
 ./easyrsa show-cert server
 
-echo Generating the Diffie Hellman parameters
-./easyrsa gen-dh
+# Finite field DH parameters are only generated for RSA setups. The daemon
+# only negotiates ECDHE key exchanges, which do not need them.
+if [ $algo = rsa ]; then
+  echo Generating the Diffie Hellman parameters
+  ./easyrsa gen-dh
+fi
 
 echo Copying server files to certs folder...
 cp ./pki/ca.crt ../certs/
 cp ./pki/issued/server.crt ../certs/
 cp ./pki/private/server.key ../certs/
-cp ./pki/dh.pem ../certs/
+if [ $algo = rsa ]; then
+  cp ./pki/dh.pem ../certs/
+fi
+
+# Empty for now. revoke_cert.sh adds the revoked certificates to it
+echo Generating the certificate revocation list
+./easyrsa gen-crl
+cp ./pki/crl.pem ../certs/
 
 cd ..
 echo Generating client certicicate...